@@ -0,0 +1,238 @@
+#pragma once
+
+#include "Bvh.h"
+#include "BvhCache.h"
+#include "ShadowPacket.h"
+#include "Thing.h"
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Things with an acceleration tree over the bounded ones; unbounded things
+// (planes) are tested against every ray. Tree is bvh or a wide_bvh, which
+// share build(), closest_hit(), any_hit() and prim_indices().
+//
+// A scene exposes it to ray_tracer by forwarding intersect() and occluded():
+//
+//     std::optional<intersection> intersect(const ray& r) const { return accel.intersect(r); }
+//     bool occluded(const ray& r, float t_max) const { return accel.occluded(r, t_max); }
+//
+// Forwarding occluder() as well lets ray_tracer cache shadowing things:
+//
+//     const any_thing* occluder(const ray& r, float t_max) const { return accel.occluder(r, t_max); }
+//
+// and optionally the packet form, which shades several lights per shadow
+// query:
+//
+//     std::uint32_t occluded(const shadow_packet& p) const { return accel.occluded(p); }
+template <typename Tree>
+class thing_accelerator {
+public:
+	explicit thing_accelerator(const std::vector<any_thing>& things, bvh_build_stats* stats = nullptr) {
+		const auto bounds = bounded(things);
+		m_tree.build(static_cast<std::uint32_t>(bounds.size()), [&](const std::uint32_t i) { return bounds[i]; }, stats);
+		place(things);
+	}
+
+	// For a bvh or wide_bvh tree: reuses the tree stored at cache_path if it
+	// was built for things with the same bounds, otherwise builds it and
+	// stores it there (see bvh_cache::load_or_build).
+	thing_accelerator(const std::vector<any_thing>& things, const std::string& cache_path, bvh_build_stats* stats = nullptr) {
+		const auto bounds = bounded(things);
+		bvh_cache::load_or_build(m_tree, cache_path, static_cast<std::uint32_t>(bounds.size()),
+			[&](const std::uint32_t i) { return bounds[i]; }, stats);
+		place(things);
+	}
+
+	// For animation with a bvh tree: `things` is the list this was built
+	// from with the entries listed in `moved` changed. Refits the tree, or
+	// rebuilds it once it has degraded too far (see bvh::update). Things may
+	// move and resize but not switch between bounded and unbounded.
+	bvh_update_result update(const std::vector<any_thing>& things, const std::vector<std::uint32_t>& moved,
+		const float rebuild_threshold = bvh::default_rebuild_threshold) {
+		if (things.size() != m_slot_of.size()) {
+			throw std::invalid_argument{ "thing_accelerator::update needs every thing it was built from" };
+		}
+		std::vector<std::uint32_t> moved_prims;
+		for (const auto i : moved) {
+			if (i >= m_slot_of.size()) {
+				throw std::out_of_range{ "thing_accelerator::update: moved index past the things it was built from" };
+			}
+			const auto slot = m_slot_of[i];
+			if (things[i].bounds().has_value() != (slot < m_bounded)) {
+				throw std::invalid_argument{ "a thing cannot switch between bounded and unbounded" };
+			}
+			m_things[slot] = things[i];
+			if (slot < m_bounded) {
+				moved_prims.push_back(m_tree.prim_indices()[slot]);
+			}
+		}
+		const auto result = m_tree.update(moved_prims, [&](const std::uint32_t prim) {
+			return *things[m_sources[prim]].bounds();
+		}, rebuild_threshold);
+		if (result.rebuilt) {
+			place(things);
+		}
+		return result;
+	}
+
+	// Closest hit in (0, t_max); shrinks t_max on a hit.
+	bool closest_hit(const ray& r, float& t_max, intersection& hit) const {
+		const auto test = [&](const any_thing& thing, float& t) {
+			const auto isect = thing.intersect(r);
+			if (isect && isect->dist > 0.0f && isect->dist < t) {
+				t = isect->dist;
+				hit = *isect;
+				return true;
+			}
+			return false;
+		};
+		auto found = m_tree.closest_hit(r, t_max, [&](const std::uint32_t slot, float& t) {
+			return test(m_things[slot], t);
+		});
+		for (auto i = m_bounded; i < m_things.size(); i++) {
+			found |= test(m_things[i], t_max);
+		}
+		return found;
+	}
+
+	std::optional<intersection> intersect(const ray& r) const {
+		auto t_max{ std::numeric_limits<float>::max() };
+		intersection hit{};
+		if (!closest_hit(r, t_max, hit)) {
+			return std::nullopt;
+		}
+		return hit;
+	}
+
+	// Whether anything is hit in (0, t_max). Stops at the first hit found.
+	bool occluded(const ray& r, const float t_max) const {
+		return occluder(r, t_max) != nullptr;
+	}
+
+	// The first thing found blocking r in (0, t_max), or nullptr. It may be
+	// tested again later with any_thing::intersect, e.g. by occluder_cache.
+	const any_thing* occluder(const ray& r, const float t_max) const {
+		const auto test = [&](const any_thing& thing) {
+			const auto isect = thing.intersect(r);
+			return isect && isect->dist > 0.0f && isect->dist < t_max;
+		};
+		const any_thing* found{ nullptr };
+		if (m_tree.any_hit(r, t_max, [&](const std::uint32_t slot, float) {
+			if (test(m_things[slot])) {
+				found = &m_things[slot];
+				return true;
+			}
+			return false;
+		})) {
+			return found;
+		}
+		for (auto i = m_bounded; i < m_things.size(); i++) {
+			if (test(m_things[i])) {
+				return &m_things[i];
+			}
+		}
+		return nullptr;
+	}
+
+	// Lanes of p that occluded() would report blocked. Trees derived from
+	// bvh are walked once for the whole packet, others once per lane.
+	std::uint32_t occluded(const shadow_packet& p) const {
+		const auto blocks = [&](const any_thing& thing, const std::uint32_t lanes) {
+			std::uint32_t blocked{ 0 };
+			if (const auto* s = thing.get_if<sphere>()) {
+				const vec3 eo = s->centre - p.origin;
+				const auto eo2 = dot(eo, eo);
+				for (auto i = 0; i < p.count; i++) {
+					if (lanes & (1u << i)) {
+						const auto dist = s->hit_distance(eo, eo2, { p.dir_x[i], p.dir_y[i], p.dir_z[i] });
+						if (dist > 0.0f && dist < p.t_max[i]) {
+							blocked |= 1u << i;
+						}
+					}
+				}
+				return blocked;
+			}
+			for (auto i = 0; i < p.count; i++) {
+				if (lanes & (1u << i)) {
+					const auto isect = thing.intersect(p.lane(i));
+					if (isect && isect->dist > 0.0f && isect->dist < p.t_max[i]) {
+						blocked |= 1u << i;
+					}
+				}
+			}
+			return blocked;
+		};
+		std::uint32_t blocked{ 0 };
+		if constexpr (std::is_base_of_v<bvh, Tree>) {
+			blocked = packet_any_hit(m_tree, p, [&](const std::uint32_t slot, const std::uint32_t lanes) {
+				return blocks(m_things[slot], lanes);
+			});
+		}
+		else {
+			for (auto i = 0; i < p.count; i++) {
+				if (m_tree.any_hit(p.lane(i), p.t_max[i], [&](const std::uint32_t slot, float) { return blocks(m_things[slot], 1u << i) != 0; })) {
+					blocked |= 1u << i;
+				}
+			}
+		}
+		for (auto i = m_bounded; i < m_things.size() && blocked != p.lanes(); i++) {
+			blocked |= blocks(m_things[i], p.lanes() & ~blocked);
+		}
+		return blocked;
+	}
+
+	bool is_bounded() const noexcept {
+		return m_bounded == m_things.size();
+	}
+
+	aabb bounds() const noexcept {
+		return m_tree.bounds();
+	}
+
+	const Tree& tree() const noexcept {
+		return m_tree;
+	}
+
+private:
+	// Bounds of the bounded things, which become the tree's primitives.
+	std::vector<aabb> bounded(const std::vector<any_thing>& things) {
+		std::vector<aabb> bounds;
+		for (std::uint32_t i = 0; i < things.size(); i++) {
+			if (const auto b = things[i].bounds(); b) {
+				m_sources.push_back(i);
+				bounds.push_back(*b);
+			}
+		}
+		return bounds;
+	}
+
+	// Copies things into slot order after a build.
+	void place(const std::vector<any_thing>& things) {
+		m_things.clear();
+		m_things.reserve(things.size());
+		m_slot_of.assign(things.size(), 0);
+		for (const auto prim : m_tree.prim_indices()) {
+			m_slot_of[m_sources[prim]] = static_cast<std::uint32_t>(m_things.size());
+			m_things.push_back(things[m_sources[prim]]);
+		}
+		m_bounded = static_cast<std::uint32_t>(m_things.size());
+		for (std::uint32_t i = 0; i < things.size(); i++) {
+			if (!things[i].bounds()) {
+				m_slot_of[i] = static_cast<std::uint32_t>(m_things.size());
+				m_things.push_back(things[i]);
+			}
+		}
+	}
+
+	std::vector<any_thing> m_things;	// bounded things in tree slot order, then unbounded ones
+	std::uint32_t m_bounded{ 0 };
+	std::vector<std::uint32_t> m_sources;	// index in the original list of each tree primitive
+	std::vector<std::uint32_t> m_slot_of;	// position in m_things of each original thing
+	Tree m_tree;
+};
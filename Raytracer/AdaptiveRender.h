@@ -0,0 +1,159 @@
+#pragma once
+
+#include "Raytracer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+struct adaptive_settings {
+	int block_size{ 8 };		// spacing of the first pass of traced corners
+	float max_error{ 0.05f };	// largest per-channel deviation from the corner mean that is still interpolated
+	bool show_traced{ false };	// debug overlay: paint every traced pixel magenta
+};
+
+namespace adaptive {
+	namespace detail {
+		enum pixel_state : std::uint8_t {
+			empty,
+			interpolated,
+			traced
+		};
+
+		// Quadtree refinement of one tile. Blocks whose corners hit the same
+		// thing with the same lights occluded and similar colors are filled by
+		// bilinear interpolation; any other block is split and its new corners
+		// are traced.
+		template <typename Scene>
+		struct block_refiner {
+			const ray_tracer& tracer;
+			const Scene& scene;
+			const int width, height;
+			const tile& t;
+			const adaptive_settings& settings;
+			pixel_sample* samples;
+			pixel_state* state;
+			render_stats& stats;
+			occluder_cache& occluders;
+
+			const pixel_sample& sample(const int x, const int y) {
+				const auto i = y * t.width + x;
+				if (state[i] != traced) {
+					if (state[i] == interpolated) {
+						stats.interpolated_pixels--;
+					}
+					samples[i] = tracer.sample_pixel(scene, width, height, t.x0 + x, t.y0 + y, &occluders);
+					state[i] = traced;
+					stats.primary_rays++;
+				}
+				return samples[i];
+			}
+
+			bool coherent(const pixel_sample& c00, const pixel_sample& c10,
+				const pixel_sample& c01, const pixel_sample& c11, const pixel_sample& mid) const {
+				for (const auto* c : { &c10, &c01, &c11, &mid }) {
+					if (c->thing != c00.thing || c->shadow_mask != c00.shadow_mask) {
+						return false;
+					}
+				}
+				const auto mean = (c00.col + c10.col + c01.col + c11.col).scale(0.25f);
+				for (const auto* c : { &c00, &c10, &c01, &c11, &mid }) {
+					if (std::abs(c->col.r - mean.r) > settings.max_error ||
+						std::abs(c->col.g - mean.g) > settings.max_error ||
+						std::abs(c->col.b - mean.b) > settings.max_error) {
+						return false;
+					}
+				}
+				return true;
+			}
+
+			void interpolate(const int x0, const int y0, const int x1, const int y1,
+				const color& c00, const color& c10, const color& c01, const color& c11) {
+				const auto inv_w = x1 > x0 ? 1.0f / (x1 - x0) : 0.0f;
+				const auto inv_h = y1 > y0 ? 1.0f / (y1 - y0) : 0.0f;
+				for (auto y = y0; y <= y1; y++) {
+					const auto fy = (y - y0) * inv_h;
+					for (auto x = x0; x <= x1; x++) {
+						const auto i = y * t.width + x;
+						if (state[i] != empty) {
+							continue;
+						}
+						const auto fx = (x - x0) * inv_w;
+						const auto top = c00.scale(1.0f - fx) + c10.scale(fx);
+						const auto bottom = c01.scale(1.0f - fx) + c11.scale(fx);
+						samples[i].col = top.scale(1.0f - fy) + bottom.scale(fy);
+						state[i] = interpolated;
+						stats.interpolated_pixels++;
+					}
+				}
+			}
+
+			void refine(const int x0, const int y0, const int x1, const int y1) {
+				const auto& c00 = sample(x0, y0);
+				const auto& c10 = sample(x1, y0);
+				const auto& c01 = sample(x0, y1);
+				const auto& c11 = sample(x1, y1);
+
+				const auto split_x = x1 - x0 > 1;
+				const auto split_y = y1 - y0 > 1;
+				if (!split_x && !split_y) {
+					return;
+				}
+
+				// The midpoint is a corner of the children if the block is
+				// split, so testing it too costs at most one ray, and catches
+				// detail smaller than the block that all four corners miss.
+				const auto xm = split_x ? (x0 + x1) / 2 : x1;
+				const auto ym = split_y ? (y0 + y1) / 2 : y1;
+				if (coherent(c00, c10, c01, c11, sample((x0 + x1) / 2, (y0 + y1) / 2))) {
+					interpolate(x0, y0, x1, y1, c00.col, c10.col, c01.col, c11.col);
+					return;
+				}
+
+				refine(x0, y0, xm, ym);
+				if (split_x) {
+					refine(xm, y0, x1, ym);
+				}
+				if (split_y) {
+					refine(x0, ym, xm, y1);
+				}
+				if (split_x && split_y) {
+					refine(xm, ym, x1, y1);
+				}
+			}
+		};
+	} // end namespace detail
+
+	// Preview renderer: traces block corners first and only subdivides where
+	// the corners disagree, so flat regions cost a handful of rays per block.
+	// Trades exactness for speed; settings.max_error bounds how far the
+	// interpolated corners may stray from each other.
+	template <typename Scene, typename Canvas>
+	void render(const ray_tracer& tracer, const Scene& scene, Canvas& canvas, const int width, const int height,
+		const adaptive_settings& settings, render_context& ctx) {
+
+		const auto block = std::max(settings.block_size, 1);
+		ctx.begin_frame();
+		ctx.for_each_tile(width, height, 4 * block, [&](const tile& t, arena& scratch, render_stats& stats) {
+			const auto count = t.width * t.height;
+			auto* samples = scratch.allocate_array<pixel_sample>(count);
+			auto* state = scratch.allocate_array<detail::pixel_state>(count);
+			detail::block_refiner<Scene> refiner{ tracer, scene, width, height, t, settings, samples, state, stats,
+				ctx.get_occluders(workers::index()) };
+
+			for (auto by = 0; by < std::max(t.height - 1, 1); by += block) {
+				for (auto bx = 0; bx < std::max(t.width - 1, 1); bx += block) {
+					refiner.refine(bx, by, std::min(bx + block, t.width - 1), std::min(by + block, t.height - 1));
+				}
+			}
+
+			for (auto y = 0; y < t.height; y++) {
+				for (auto x = 0; x < t.width; x++) {
+					const auto i = y * t.width + x;
+					const auto show = settings.show_traced && state[i] == detail::traced;
+					canvas.set_pixel(t.x0 + x, t.y0 + y, show ? color{ 1.0f, 0.0f, 1.0f } : samples[i].col);
+				}
+			}
+		});
+	}
+} // end namespace adaptive
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifdef __linux__
+	#include <sys/mman.h>
+#endif
+
+// Bump-pointer allocator for per-frame scratch memory. The backing block is
+// reserved (and pre-faulted) once when the arena is created; after that,
+// allocations only advance an offset and never touch the global heap.
+// Everything is released at once with reset(), typically between frames.
+class arena {
+public:
+	struct marker {
+		std::size_t offset;
+	};
+
+	// capacity is rounded up to whole pages, and to whole 2 MiB huge pages
+	// only when they are asked for.
+	explicit arena(const std::size_t capacity, const bool use_huge_pages = false)
+		: m_capacity{ round_up(capacity == 0 ? 1 : capacity, use_huge_pages ? m_hugePageSize : m_pageSize) }
+	{
+		map_block(use_huge_pages);
+	}
+
+	~arena() {
+		unmap_block();
+	}
+
+	arena(const arena&) = delete;
+	arena& operator=(const arena&) = delete;
+
+	arena(arena&& other) noexcept
+		: m_base{ std::exchange(other.m_base, nullptr) },
+		m_capacity{ std::exchange(other.m_capacity, 0) },
+		m_offset{ std::exchange(other.m_offset, 0) },
+		m_highWater{ std::exchange(other.m_highWater, 0) },
+		m_mapped{ std::exchange(other.m_mapped, false) },
+		m_hugePages{ std::exchange(other.m_hugePages, false) }
+	{}
+
+	arena& operator=(arena&& other) noexcept {
+		if (this != &other) {
+			unmap_block();
+			m_base = std::exchange(other.m_base, nullptr);
+			m_capacity = std::exchange(other.m_capacity, 0);
+			m_offset = std::exchange(other.m_offset, 0);
+			m_highWater = std::exchange(other.m_highWater, 0);
+			m_mapped = std::exchange(other.m_mapped, false);
+			m_hugePages = std::exchange(other.m_hugePages, false);
+		}
+		return *this;
+	}
+
+	// Throws std::bad_alloc when the arena is exhausted, like operator new.
+	void* allocate(const std::size_t size, const std::size_t align = alignof(std::max_align_t)) {
+		const auto start = round_up(m_offset, align);
+		if (start + size > m_capacity) {
+			throw std::bad_alloc{};
+		}
+		m_offset = start + size;
+		if (m_offset > m_highWater) {
+			m_highWater = m_offset;
+		}
+		return m_base + start;
+	}
+
+	// Scratch objects are never destroyed individually, so only trivially
+	// destructible types may live in an arena.
+	template <typename T>
+	T* allocate_array(const std::size_t count) {
+		static_assert(std::is_trivially_destructible_v<T>, "arena memory is released without running destructors");
+		auto* p = static_cast<T*>(allocate(count * sizeof(T), alignof(T)));
+		for (std::size_t i = 0; i < count; ++i) {
+			::new (static_cast<void*>(p + i)) T{};
+		}
+		return p;
+	}
+
+	template <typename T, typename... Args>
+	T* create(Args&&... args) {
+		static_assert(std::is_trivially_destructible_v<T>, "arena memory is released without running destructors");
+		return ::new (allocate(sizeof(T), alignof(T))) T{ std::forward<Args>(args)... };
+	}
+
+	marker mark() const noexcept { return { m_offset }; }
+	void rewind(const marker m) noexcept { m_offset = m.offset; }
+	void reset() noexcept { m_offset = 0; }
+
+	std::size_t used() const noexcept { return m_offset; }
+	std::size_t capacity() const noexcept { return m_capacity; }
+	std::size_t high_water() const noexcept { return m_highWater; }
+	bool uses_huge_pages() const noexcept { return m_hugePages; }
+
+private:
+	static constexpr std::size_t m_pageSize{ 4u << 10 };
+	static constexpr std::size_t m_hugePageSize{ 2u << 20 }; // one x86-64 huge page
+
+	static constexpr std::size_t round_up(const std::size_t val, const std::size_t align) {
+		return (val + align - 1) & ~(align - 1);
+	}
+
+	void map_block(const bool use_huge_pages) {
+#ifdef __linux__
+		void* p = MAP_FAILED;
+		if (use_huge_pages) {
+			// Explicit huge pages need a reserved hugetlbfs pool; fall back to
+			// transparent huge pages if none are available.
+			p = mmap(nullptr, m_capacity, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+			m_hugePages = p != MAP_FAILED;
+		}
+		if (p == MAP_FAILED) {
+			p = mmap(nullptr, m_capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED) {
+				throw std::bad_alloc{};
+			}
+			if (use_huge_pages) {
+				m_hugePages = madvise(p, m_capacity, MADV_HUGEPAGE) == 0;
+			}
+		}
+		m_base = static_cast<std::byte*>(p);
+		m_mapped = true;
+#else
+		(void)use_huge_pages;
+		m_base = static_cast<std::byte*>(::operator new(m_capacity, std::align_val_t{ 64 }));
+#endif
+		// Touch every page now so that frames never take a first-use fault.
+		std::memset(m_base, 0, m_capacity);
+	}
+
+	void unmap_block() noexcept {
+		if (!m_base) {
+			return;
+		}
+#ifdef __linux__
+		if (m_mapped) {
+			munmap(m_base, m_capacity);
+		}
+#else
+		::operator delete(m_base, std::align_val_t{ 64 });
+#endif
+		m_base = nullptr;
+	}
+
+	std::byte* m_base{ nullptr };
+	std::size_t m_capacity{ 0 };
+	std::size_t m_offset{ 0 };
+	std::size_t m_highWater{ 0 };
+	bool m_mapped{ false };
+	bool m_hugePages{ false };
+};
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "Raytracer.h"
+#include "SceneVersions.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+
+// Handle to a frame being rendered on a background thread. Progress and
+// cancellation are tracked per tile; cancel() stops the frame as soon as
+// every worker finishes the tile it is on. Destroying the handle cancels the
+// frame and waits for it.
+class render_job {
+public:
+	render_job(render_job&&) noexcept = default;
+
+	render_job& operator=(render_job&& other) noexcept {
+		if (this != &other) {
+			if (m_state) {
+				cancel();
+				m_finished.wait();
+				m_ctx->forget_background_frame(m_state.get());
+			}
+			m_finished = std::move(other.m_finished);
+			m_state = std::move(other.m_state);
+			m_ctx = other.m_ctx;
+		}
+		return *this;
+	}
+
+	~render_job() {
+		if (m_state) {
+			cancel();
+			m_finished.wait();
+			m_ctx->forget_background_frame(m_state.get());
+		}
+	}
+
+	// A moved-from job has no frame: it counts as cancelled and finished,
+	// with no progress and no completed tiles.
+	void cancel() noexcept {
+		if (m_state) {
+			m_state->cancelled.store(true, std::memory_order_relaxed);
+		}
+	}
+
+	bool cancelled() const noexcept {
+		return !m_state || m_state->cancelled.load(std::memory_order_relaxed);
+	}
+
+	// Fraction of tiles finished, in [0, 1]; a frame with no tiles is
+	// done from the start.
+	float progress() const noexcept {
+		if (!m_state) {
+			return 0.0f;
+		}
+		if (m_state->tile_count == 0) {
+			return 1.0f;
+		}
+		return static_cast<float>(m_state->tiles_done.load(std::memory_order_relaxed)) / m_state->tile_count;
+	}
+
+	bool finished() const {
+		return !m_finished.valid() || m_finished.wait_for(std::chrono::seconds{ 0 }) == std::future_status::ready;
+	}
+
+	// Waits for the frame, then rethrows whatever stopped it rendering.
+	void wait() const {
+		if (m_state) {
+			m_finished.wait();
+			m_ctx->forget_background_frame(m_state.get());
+			m_finished.get();
+		}
+	}
+
+	// Calls func(tile) for every tile that has been fully written to the
+	// canvas so far; safe to call while the frame is still rendering.
+	template <typename Func>
+	void for_each_completed_tile(Func&& func) const {
+		if (!m_state) {
+			return;
+		}
+		for (auto i = 0; i < m_state->tile_count; i++) {
+			if (m_state->tile_done[i].load(std::memory_order_acquire)) {
+				func(m_state->get_tile(i));
+			}
+		}
+	}
+
+private:
+	template <typename ScenePtr, typename Canvas>
+	friend render_job start_render_job(const ray_tracer&, ScenePtr, Canvas&, int, int, render_context&);
+
+	static constexpr int m_tileSize{ 16 };
+
+	struct shared_state {
+		int width, height;
+		int tiles_x, tile_count;
+		std::atomic<bool> cancelled{ false };
+		std::atomic<int> tiles_done{ 0 };
+		std::unique_ptr<std::atomic<bool>[]> tile_done;
+
+		shared_state(const int width, const int height)
+			: width{ width },
+			height{ height },
+			tiles_x{ (width + m_tileSize - 1) / m_tileSize },
+			tile_count{ tiles_x * ((height + m_tileSize - 1) / m_tileSize) },
+			tile_done{ std::make_unique<std::atomic<bool>[]>(tile_count) }
+		{}
+
+		tile get_tile(const int i) const noexcept {
+			const auto x0 = (i % tiles_x) * m_tileSize;
+			const auto y0 = (i / tiles_x) * m_tileSize;
+			return { x0, y0, std::min(m_tileSize, width - x0), std::min(m_tileSize, height - y0) };
+		}
+	};
+
+	render_job(std::shared_ptr<shared_state> state, std::shared_future<void> finished, render_context& ctx)
+		: m_state{ std::move(state) },
+		m_finished{ std::move(finished) },
+		m_ctx{ &ctx }
+	{}
+
+	std::shared_ptr<shared_state> m_state;		// shared with the context, which stops the frame when the next one begins
+	std::shared_future<void> m_finished;
+	render_context* m_ctx{ nullptr };			// told when the frame is over, to drop its stop hook
+};
+
+// Renders the scene scene_ptr points to; the job keeps scene_ptr itself,
+// so a shared pointer keeps its scene alive until the frame ends.
+template <typename ScenePtr, typename Canvas>
+render_job start_render_job(const ray_tracer& tracer, ScenePtr scene_ptr, Canvas& canvas, const int width, const int height,
+	render_context& ctx) {
+
+	// The frame before on this context must have stopped using it.
+	ctx.finish_background_frame();
+	auto state = std::make_shared<render_job::shared_state>(width, height);
+	auto* s = state.get();
+
+	std::shared_future<void> finished = std::async(std::launch::async, [tracer, scene_ptr = std::move(scene_ptr), &canvas, &ctx, s]() mutable {
+		const auto& scene = *scene_ptr;
+		ctx.begin_background_frame();
+		// Ends the frame even if a tile throws; the job's wait() rethrows.
+		// The future keeps this lambda, so the scene is let go of here, once
+		// no cached occluder points into it, rather than with the future.
+		struct frame_guard {
+			render_context& ctx;
+			ScenePtr& scene_ptr;
+			~frame_guard() {
+				ctx.end_background_frame();
+				scene_ptr = nullptr;
+			}
+		} guard{ ctx, scene_ptr };
+		ctx.for_each_tile(s->width, s->height, render_job::m_tileSize, [&](const tile& t, arena&, render_stats& stats) {
+			if (s->cancelled.load(std::memory_order_relaxed)) {
+				return;
+			}
+			auto& occluders = ctx.get_occluders(workers::index());
+			for (auto y = t.y0; y < t.y0 + t.height; y++) {
+				for (auto x = t.x0; x < t.x0 + t.width; x++) {
+					canvas.set_pixel(x, y, tracer.sample_pixel(scene, s->width, s->height, x, y, &occluders).col);
+				}
+			}
+			stats.primary_rays += t.width * t.height;
+
+			const auto i = (t.y0 / render_job::m_tileSize) * s->tiles_x + t.x0 / render_job::m_tileSize;
+			s->tile_done[i].store(true, std::memory_order_release);
+			s->tiles_done.fetch_add(1, std::memory_order_relaxed);
+		});
+	});
+
+	ctx.set_background_frame([state, finished] {
+		state->cancelled.store(true, std::memory_order_relaxed);
+		finished.wait();
+	}, s);
+	return render_job{ std::move(state), std::move(finished), ctx };
+}
+
+// Starts rendering a frame in the background and returns immediately. The
+// scene, canvas and context must outlive the returned job. A frame still
+// rendering on ctx, such as the one a job about to be replaced by this one
+// holds, is cancelled and waited for first, as is this one when any later
+// frame begins on ctx.
+template <typename Scene, typename Canvas>
+render_job render_async(const ray_tracer& tracer, const Scene& scene, Canvas& canvas, const int width, const int height,
+	render_context& ctx) {
+	return start_render_job(tracer, &scene, canvas, width, height, ctx);
+}
+
+// Likewise for the version of scene current when called, which the job
+// renders throughout and keeps alive however the scene is edited meanwhile.
+// Only the canvas and context must outlive the job. Frames on one context
+// run one after another, each with fresh occluder caches that it empties
+// before letting go of its version, so no cached thing outlives the
+// version it belongs to.
+template <typename Scene, typename Canvas>
+render_job render_async(const ray_tracer& tracer, const scene_versions<Scene>& scene, Canvas& canvas, const int width,
+	const int height, render_context& ctx) {
+	return start_render_job(tracer, scene.current(), canvas, width, height, ctx);
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+#include "Accelerator.h"
+#include "Camera.h"
+#include "LazyBvh.h"
+#include "Light.h"
+#include "QuantizedBvh.h"
+#include "Raytracer.h"
+#include "SphereGrid.h"
+#include "StacklessBvh.h"
+#include "Thing.h"
+#include "WideBvh.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <random>
+#include <vector>
+
+// Benchmark driver for the accelerators: builds each one over the same
+// seeded scenes and times the build and one pass of closest-hit and one of
+// any-hit queries over the same random rays. The hit counts and distance
+// sums printed with each line should agree between accelerators to within
+// a few rays grazing box or cell edges; more than that means one of them is
+// wrong, not faster.
+//
+// It then renders one scene with each binary and wide bvh, and with a
+// growing number of lights, testing shadow rays one light at a time and as
+// shadow packets. Every render counts the pixels where it differs from the
+// first, which should be none.
+//
+// Run as `Raytracer --bench`. Timings are for whatever worker count OpenMP
+// chooses; set OMP_NUM_THREADS to compare like with like.
+namespace bench {
+	struct settings {
+		std::uint32_t ray_count{ 1000000 };
+		float shadow_distance{ 10.0f };	// t_max for the any-hit queries
+		int width{ 320 };	// of the shadow renders
+		int height{ 240 };
+	};
+
+	namespace detail {
+		using clock = std::chrono::steady_clock;
+
+		inline double ms_since(const clock::time_point start) {
+			return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+		}
+
+		// count spheres in a cube of side 2 * extent over a ground plane, or
+		// with clustered, packed into eight clumps with a few far outliers.
+		inline std::vector<any_thing> spheres(const std::uint32_t count, const float extent, const bool clustered) {
+			std::mt19937 rng{ 11 };
+			std::uniform_real_distribution<float> u{ -1.0f, 1.0f };
+			std::vector<any_thing> things;
+			things.reserve(count + 1);
+			things.emplace_back(plane{ { 0.0f, 1.0f, 0.0f }, extent, surfaces::checkerboard });
+			for (std::uint32_t i = 0; i < count; i++) {
+				vec3 centre{ u(rng) * extent, u(rng) * extent, u(rng) * extent };
+				if (clustered && i % 50 != 0) {
+					const auto k = rng() % 8;
+					const vec3 clump{ (k & 1 ? 0.5f : -0.5f) * extent, (k & 2 ? 0.5f : -0.5f) * extent, (k & 4 ? 0.5f : -0.5f) * extent };
+					centre = clump + 0.1f * centre;
+				}
+				things.emplace_back(sphere{ centre, 0.2f, surfaces::shiny });
+			}
+			return things;
+		}
+
+		inline std::vector<ray> rays(const std::uint32_t count, const float extent) {
+			std::mt19937 rng{ 7 };
+			std::uniform_real_distribution<float> u{ -1.0f, 1.0f };
+			std::vector<ray> out;
+			out.reserve(count);
+			for (std::uint32_t i = 0; i < count; i++) {
+				out.push_back({ 1.5f * extent * vec3{ u(rng), u(rng), u(rng) }, norm(vec3{ u(rng), u(rng), u(rng) }) });
+			}
+			return out;
+		}
+
+		template <typename Accelerator, typename... Args>
+		void run_one(const char* name, const std::vector<any_thing>& things, const std::vector<ray>& rays,
+			const settings& s, const Args&... args) {
+			auto start = clock::now();
+			const Accelerator accel{ things, args... };
+			const auto build_ms = ms_since(start);
+
+			start = clock::now();
+			std::uint32_t hits{ 0 };
+			auto dist_sum{ 0.0 };
+			for (const auto& r : rays) {
+				if (const auto isect = accel.intersect(r)) {
+					hits++;
+					dist_sum += isect->dist;
+				}
+			}
+			const auto closest_ms = ms_since(start);
+
+			start = clock::now();
+			std::uint32_t occluded{ 0 };
+			for (const auto& r : rays) {
+				occluded += accel.occluded(r, s.shadow_distance) ? 1 : 0;
+			}
+			const auto any_ms = ms_since(start);
+
+			std::printf("  %-14s build %9.1f ms  closest %9.1f ms  any %9.1f ms  | hits %u sum %.6g occluded %u\n",
+				name, build_ms, closest_ms, any_ms, hits, dist_sum, occluded);
+		}
+
+		struct canvas {
+			int width;
+			std::vector<color> pixels;
+
+			void set_pixel(const int x, const int y, const color& c) {
+				pixels[static_cast<std::size_t>(y) * width + x] = c;
+			}
+		};
+
+		inline std::size_t differing_pixels(const canvas& a, const canvas& b) {
+			std::size_t differing{ 0 };
+			for (std::size_t i = 0; i < a.pixels.size(); i++) {
+				const auto& pa = a.pixels[i];
+				const auto& pb = b.pixels[i];
+				differing += pa.r != pb.r || pa.g != pb.g || pa.b != pb.b ? 1 : 0;
+			}
+			return differing;
+		}
+
+		// Shades each light with its own shadow ray.
+		template <typename Accelerator>
+		struct shadow_scene {
+			const Accelerator& accel;
+			std::vector<light> lights;
+			camera cam;
+
+			std::optional<intersection> intersect(const ray& r) const {
+				return accel.intersect(r);
+			}
+
+			bool occluded(const ray& r, const float t_max) const {
+				return accel.occluded(r, t_max);
+			}
+
+			const std::vector<light>& get_lights() const {
+				return lights;
+			}
+
+			const camera& get_camera() const {
+				return cam;
+			}
+		};
+
+		// Shades up to shadow_packet::width lights per shadow query.
+		struct packet_shadow_scene : shadow_scene<thing_accelerator<bvh>> {
+			using shadow_scene::occluded;
+
+			std::uint32_t occluded(const shadow_packet& p) const {
+				return accel.occluded(p);
+			}
+		};
+
+		// 20k spheres scattered over a ground plane, and count lights above
+		// them.
+		inline std::vector<any_thing> render_things() {
+			std::mt19937 rng{ 21 };
+			std::uniform_real_distribution<float> u{ -1.0f, 1.0f };
+			std::vector<any_thing> things;
+			things.emplace_back(plane{ { 0.0f, 1.0f, 0.0f }, 0.0f, surfaces::checkerboard });
+			for (auto i = 0; i < 20000; i++) {
+				things.emplace_back(sphere{ { u(rng) * 60.0f, 1.0f + (u(rng) + 1.0f) * 6.0f, u(rng) * 60.0f }, 0.6f, surfaces::shiny });
+			}
+			return things;
+		}
+
+		inline std::vector<light> render_lights(const int count) {
+			std::mt19937 rng{ static_cast<std::uint32_t>(count) };
+			std::uniform_real_distribution<float> u{ -1.0f, 1.0f };
+			std::vector<light> lights;
+			for (auto i = 0; i < count; i++) {
+				lights.push_back({ { u(rng) * 60.0f, 20.0f + u(rng) * 10.0f, u(rng) * 60.0f }, { 0.3f, 0.25f, 0.2f } });
+			}
+			return lights;
+		}
+
+		inline constexpr camera render_camera{ { 0.0f, 30.0f, 90.0f }, { 0.0f, 0.0f, 0.0f } };
+
+		// Renders into pixels and returns the time taken, not counting the
+		// build.
+		template <typename Accelerator>
+		double render_with(const std::vector<any_thing>& things, const std::vector<light>& lights, canvas& pixels,
+			const settings& s) {
+			const Accelerator accel{ things };
+			const shadow_scene<Accelerator> scene{ accel, lights, render_camera };
+			const auto start = clock::now();
+			ray_tracer{}.render(scene, pixels, s.width, s.height);
+			return ms_since(start);
+		}
+
+		inline void run_renders(const std::vector<any_thing>& things, const settings& s) {
+			const auto lights = render_lights(4);
+			canvas first{ s.width, std::vector<color>(static_cast<std::size_t>(s.width) * s.height) };
+			auto pixels = first;
+
+			std::printf("20k spheres, 4 lights, %dx%d, one render per tree\n", s.width, s.height);
+			const auto bvh_ms = render_with<thing_accelerator<bvh>>(things, lights, first, s);
+			std::printf("  %-14s render %9.1f ms\n", "bvh", bvh_ms);
+			const auto bvh4_ms = render_with<thing_accelerator<bvh4>>(things, lights, pixels, s);
+			std::printf("  %-14s render %9.1f ms  | differing pixels %zu\n", "bvh4", bvh4_ms, differing_pixels(first, pixels));
+			const auto bvh8_ms = render_with<thing_accelerator<bvh8>>(things, lights, pixels, s);
+			std::printf("  %-14s render %9.1f ms  | differing pixels %zu\n", "bvh8", bvh8_ms, differing_pixels(first, pixels));
+		}
+
+		inline void run_shadows(const std::vector<any_thing>& things, const settings& s) {
+			const thing_accelerator<bvh> accel{ things };
+			const ray_tracer tracer{};
+
+			std::printf("20k spheres with a bvh, %dx%d, shadow rays per light and as packets\n", s.width, s.height);
+			for (const auto light_count : { 4, 8, 16, 32 }) {
+				const auto lights = render_lights(light_count);
+				const shadow_scene<thing_accelerator<bvh>> single{ accel, lights, render_camera };
+				const packet_shadow_scene packets{ { accel, lights, render_camera } };
+				canvas single_pixels{ s.width, std::vector<color>(static_cast<std::size_t>(s.width) * s.height) };
+				auto packet_pixels = single_pixels;
+
+				auto start = clock::now();
+				tracer.render(single, single_pixels, s.width, s.height);
+				const auto single_ms = ms_since(start);
+				start = clock::now();
+				tracer.render(packets, packet_pixels, s.width, s.height);
+				const auto packet_ms = ms_since(start);
+
+				std::printf("  %2d lights      per light %9.1f ms  packets %9.1f ms  | differing pixels %zu\n",
+					light_count, single_ms, packet_ms, differing_pixels(single_pixels, packet_pixels));
+			}
+		}
+	} // end namespace detail
+
+	// Prints one line per accelerator and scene, then per render, to stdout.
+	inline int run(const settings& s = {}) {
+		struct scene_spec {
+			const char* name;
+			std::uint32_t count;
+			float extent;
+			bool clustered;
+		};
+		const scene_spec scenes[]{
+			{ "1k spheres", 1000, 100.0f, false },
+			{ "100k spheres", 100000, 100.0f, false },
+			{ "1M spheres", 1000000, 100.0f, false },
+			{ "300k clustered spheres", 300000, 100.0f, true },
+		};
+		for (const auto& spec : scenes) {
+			const auto things = detail::spheres(spec.count, spec.extent, spec.clustered);
+			const auto rays = detail::rays(s.ray_count, spec.extent);
+			std::printf("%s, %u rays\n", spec.name, s.ray_count);
+			detail::run_one<thing_accelerator<bvh>>("bvh", things, rays, s);
+			detail::run_one<thing_accelerator<bvh4>>("bvh4", things, rays, s);
+			detail::run_one<thing_accelerator<bvh8>>("bvh8", things, rays, s);
+			detail::run_one<thing_accelerator<quantized_bvh>>("quantized_bvh", things, rays, s);
+			detail::run_one<thing_accelerator<stackless_bvh>>("stackless_bvh", things, rays, s);
+			detail::run_one<thing_accelerator<lazy_bvh>>("lazy_bvh", things, rays, s);
+			detail::run_one<sphere_grid>("grid", things, rays, s);
+			detail::run_one<sphere_grid>("hashed grid", things, rays, s, sphere_grid_settings{ grid_layout::hashed });
+		}
+		const auto things = detail::render_things();
+		detail::run_renders(things, s);
+		detail::run_shadows(things, s);
+		return 0;
+	}
+} // end namespace bench
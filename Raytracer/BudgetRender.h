@@ -0,0 +1,84 @@
+#pragma once
+
+#include "ProgressiveRender.h"
+
+#include <algorithm>
+#include <chrono>
+
+// What a budgeted render managed to produce.
+struct budget_result {
+	int stride;				// finest progressive stride that was started (1 = full resolution)
+	unsigned int depth;		// reflection depth used for the passes after the first
+	bool complete;			// false if the deadline cut the last pass short
+	double elapsed_ms;
+};
+
+namespace budget {
+	// Renders the best image it can within `budget`. The 1/16 resolution pass
+	// is traced at the tracer's full depth and timed; that estimate picks the
+	// finest remaining pass and the deepest reflection depth predicted to fit.
+	// Every pass checks the deadline per tile, so an overrun is bounded by the
+	// time of one tile and the canvas keeps the coarser result there.
+	//
+	// The tracer does no supersampling, so pixel density (the progressive
+	// stride) is the only sample count to trade.
+	template <typename Scene, typename Canvas>
+	budget_result render(const ray_tracer& tracer, const Scene& scene, Canvas& canvas, const int width, const int height,
+		render_context& ctx, const std::chrono::steady_clock::duration budget) {
+
+		using clock = std::chrono::steady_clock;
+		const auto start = clock::now();
+		const auto deadline = start + budget;
+		const auto past_deadline = [deadline] { return clock::now() >= deadline; };
+		const auto elapsed_ms = [start] {
+			return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+		};
+
+		ctx.begin_frame();
+		budget_result result{ progressive::strides[0], tracer.max_depth(), true, 0.0 };
+		result.complete = progressive::render_pass(tracer, scene, canvas, width, height, ctx, 0, past_deadline);
+
+		const auto probe_rays = static_cast<double>(ctx.frame_stats().primary_rays);
+		if (!result.complete || probe_rays == 0) {
+			result.elapsed_ms = elapsed_ms();
+			return result;
+		}
+
+		// Cost of a ray is taken to scale with the length of its reflection
+		// chain, which overestimates for rays that escape early.
+		const auto full_depth_ray = std::chrono::duration<double>(clock::now() - start).count() / probe_rays;
+		const auto ray_cost = [&](const unsigned int depth) {
+			return full_depth_ray * (depth + 1) / (tracer.max_depth() + 1);
+		};
+		const auto remaining = std::chrono::duration<double>(deadline - clock::now()).count();
+		const auto pixels = static_cast<double>(width) * height;
+
+		// Pick the finest pass, then the deepest depth, that fits.
+		auto last_pass{ 0 };
+		auto depth{ tracer.max_depth() };
+		for (auto pass = static_cast<int>(progressive::strides.size()) - 1; pass > 0 && last_pass == 0; pass--) {
+			const auto s = progressive::strides[pass];
+			const auto rays = pixels / (s * s) - probe_rays;
+			for (auto d = static_cast<int>(tracer.max_depth()); d >= 0; d--) {
+				if (rays * ray_cost(d) <= remaining) {
+					last_pass = pass;
+					depth = static_cast<unsigned int>(d);
+					break;
+				}
+			}
+		}
+		if (last_pass == 0) {
+			result.elapsed_ms = elapsed_ms();
+			return result;
+		}
+
+		const ray_tracer reduced{ depth };
+		result.depth = depth;
+		for (auto pass = 1; pass <= last_pass && result.complete; pass++) {
+			result.stride = progressive::strides[pass];
+			result.complete = progressive::render_pass(reduced, scene, canvas, width, height, ctx, pass, past_deadline);
+		}
+		result.elapsed_ms = elapsed_ms();
+		return result;
+	}
+} // end namespace budget
@@ -0,0 +1,805 @@
+#pragma once
+
+#include "Geometry.h"
+#include "Workers.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+struct aabb {
+	vec3 lo{ std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+	vec3 hi{ std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest() };
+
+	constexpr void grow(const vec3& p) noexcept {
+		lo = { std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z) };
+		hi = { std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z) };
+	}
+
+	// Growing by an empty box leaves this one unchanged.
+	constexpr void grow(const aabb& b) noexcept {
+		lo = { std::min(lo.x, b.lo.x), std::min(lo.y, b.lo.y), std::min(lo.z, b.lo.z) };
+		hi = { std::max(hi.x, b.hi.x), std::max(hi.y, b.hi.y), std::max(hi.z, b.hi.z) };
+	}
+
+	constexpr bool empty() const noexcept {
+		return lo.x > hi.x;
+	}
+
+	constexpr vec3 centroid() const noexcept {
+		return 0.5f * (lo + hi);
+	}
+
+	constexpr vec3 extent() const noexcept {
+		return hi - lo;
+	}
+
+	constexpr float surface_area() const noexcept {
+		if (empty()) {
+			return 0.0f;
+		}
+		const auto e = extent();
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+};
+
+constexpr float component(const vec3& v, const int a) noexcept {
+	return a == 0 ? v.x : a == 1 ? v.y : v.z;
+}
+
+// Ray with its reciprocal direction precomputed for slab tests.
+struct bvh_ray {
+	vec3 start;
+	vec3 dir;
+	vec3 inv_dir;
+
+	constexpr bvh_ray(const ray& r) noexcept
+		: start{ r.start },
+		dir{ r.dir },
+		inv_dir{ 1.0f / r.dir.x, 1.0f / r.dir.y, 1.0f / r.dir.z }
+	{}
+
+	// Entry distance into b if the ray overlaps it within [0, t_max],
+	// otherwise +infinity.
+	constexpr float enter(const aabb& b, const float t_max) const noexcept {
+		const auto tx0 = (b.lo.x - start.x) * inv_dir.x;
+		const auto tx1 = (b.hi.x - start.x) * inv_dir.x;
+		const auto ty0 = (b.lo.y - start.y) * inv_dir.y;
+		const auto ty1 = (b.hi.y - start.y) * inv_dir.y;
+		const auto tz0 = (b.lo.z - start.z) * inv_dir.z;
+		const auto tz1 = (b.hi.z - start.z) * inv_dir.z;
+		const auto t_near = std::max({ std::min(tx0, tx1), std::min(ty0, ty1), std::min(tz0, tz1), 0.0f });
+		const auto t_far = std::min({ std::max(tx0, tx1), std::max(ty0, ty1), std::max(tz0, tz1), t_max });
+		return t_near <= t_far ? t_near : std::numeric_limits<float>::infinity();
+	}
+};
+
+struct bvh_node {
+	aabb bounds;
+	std::uint32_t first;	// first child for interior nodes (siblings are adjacent), first primitive slot for leaves
+	std::uint32_t count;	// primitives in a leaf, 0 for interior nodes
+
+	constexpr bool is_leaf() const noexcept {
+		return count != 0;
+	}
+};
+static_assert(sizeof(bvh_node) == 32, "bvh_node should fill half a cache line");
+
+struct bvh_update_result {
+	bool rebuilt{ false };	// slots were reassigned, see bvh::update()
+	float sah_cost{ 0.0f };
+	float degradation{ 1.0f };	// sah_cost relative to the cost right after the last build
+};
+
+struct bvh_build_stats {
+	double seconds{ 0.0 };
+	float sah_cost{ 0.0f };	// see bvh::sah_cost()
+	std::uint32_t nodes{ 0 };
+	std::uint32_t leaves{ 0 };
+};
+
+// Binary bounding volume hierarchy over an indexed set of primitives. The
+// tree only stores primitive indices; callers supply bounds when building
+// and intersection tests when traversing. Traversal callbacks receive a
+// primitive *slot*, a position in prim_indices(), so containers that reorder
+// their primitives into slot order can index them without the indirection.
+class bvh {
+public:
+	static constexpr std::uint32_t max_leaf_size{ 4 };
+	static constexpr int sah_bins{ 16 };
+	static constexpr float traversal_cost{ 1.0f };
+	static constexpr float intersect_cost{ 1.0f };
+	static constexpr float default_rebuild_threshold{ 1.5f };
+	// Past this depth nodes are split at the object median, which bounds the
+	// tree depth whatever the SAH decides: the at most 2^32 primitives left
+	// are halved at every level below it. Traversal stacks hold one entry
+	// per level.
+	static constexpr unsigned max_sah_depth{ 40 };
+	static constexpr unsigned max_depth{ max_sah_depth + 32 };
+
+	bvh() = default;
+
+	// Builds the tree from bounds_of(i) for i in [0, prim_count), choosing
+	// each split with a binned surface area heuristic. Large nodes near the
+	// root are binned in parallel; once there are enough of them, the
+	// remaining subtrees are built concurrently, one per worker. bounds_of
+	// is called from several threads at once.
+	template <typename BoundsOf>
+	void build(const std::uint32_t prim_count, BoundsOf&& bounds_of, bvh_build_stats* stats = nullptr) {
+		const auto start = std::chrono::steady_clock::now();
+		m_nodes.clear();
+		m_prims.resize(prim_count);
+		m_parents.clear();
+		m_axes.clear();
+		m_dirty.clear();
+		m_sah_sum = 0.0;
+		m_built_sah = 0.0f;
+		if (prim_count == 0) {
+			if (stats) {
+				*stats = {};
+			}
+			return;
+		}
+
+		build_input in{ std::vector<build_prim>(prim_count), { 1 } };
+		const auto n = static_cast<std::int64_t>(prim_count);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (std::int64_t i = 0; i < n; i++) {
+			const auto b = bounds_of(static_cast<std::uint32_t>(i));
+			in.prims[i] = { b, b.centroid(), static_cast<std::uint32_t>(i) };
+		}
+
+		// A binary tree with non-empty leaves has at most 2n - 1 nodes, so
+		// workers can claim sibling pairs from one array without locking.
+		const auto chunks = 4 * workers::count();
+		const auto [root_bounds, root_centroids] = range_bounds(0, prim_count, in, chunks);
+		m_nodes.resize(2 * static_cast<std::size_t>(prim_count) - 1);
+		if (m_keep_links) {
+			m_parents.resize(m_nodes.size());
+			m_axes.resize(m_nodes.size());
+			m_parents[0] = 0;
+		}
+		m_nodes[0] = { root_bounds, 0, prim_count };
+
+		const auto subtree_size = std::max<std::uint32_t>(4096, prim_count / (2 * chunks));
+		std::vector<build_task> pending{ { 0, 0, root_centroids } };
+		std::vector<build_task> subtrees;
+		while (!pending.empty()) {
+			const auto task = pending.back();
+			pending.pop_back();
+			build_task children[2];
+			if (m_nodes[task.node].count <= subtree_size) {
+				subtrees.push_back(task);
+			}
+			else if (split(task, in, chunks, children)) {
+				pending.push_back(children[0]);
+				pending.push_back(children[1]);
+			}
+		}
+
+		const auto subtree_count = static_cast<int>(subtrees.size());
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (auto i = 0; i < subtree_count; i++) {
+			build_subtree(subtrees[i], in);
+		}
+		m_nodes.resize(in.next_node);
+		if (m_keep_links) {
+			m_parents.resize(in.next_node);
+			m_axes.resize(in.next_node);
+		}
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (std::int64_t i = 0; i < n; i++) {
+			m_prims[i] = in.prims[i].index;
+		}
+		m_sah_sum = sah_sum();
+		m_built_sah = tracked_sah_cost();
+
+		if (stats) {
+			stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			stats->sah_cost = m_built_sah;
+			stats->nodes = static_cast<std::uint32_t>(m_nodes.size());
+			stats->leaves = static_cast<std::uint32_t>(std::count_if(m_nodes.begin(), m_nodes.end(),
+				[](const bvh_node& node) { return node.is_leaf(); }));
+		}
+	}
+
+	// Adopts a tree as nodes() and prim_indices() of an earlier build left
+	// it, e.g. one read back from a file, taking over the arrays. Throws
+	// invalid_argument unless they form a tree over prims.size() primitives
+	// that build() could have produced: children after their parent, every
+	// node and slot reached exactly once, and prims a permutation.
+	void assign(std::vector<bvh_node> nodes, std::vector<std::uint32_t> prims) {
+		const auto fail = [] { return std::invalid_argument{ "bvh::assign: arrays do not form a valid tree" }; };
+		if (prims.size() > std::numeric_limits<std::uint32_t>::max()) {
+			throw fail();
+		}
+		const auto node_count = nodes.size();
+		const auto prim_count = static_cast<std::uint32_t>(prims.size());
+		if ((prim_count == 0) != (node_count == 0) || (prim_count > 0 && node_count > 2 * static_cast<std::size_t>(prim_count) - 1)) {
+			throw fail();
+		}
+		// Children come after their parent and each node has one parent, so
+		// with 2k + 1 nodes for k interior ones all are reachable from the root.
+		constexpr auto no_parent = std::numeric_limits<std::uint32_t>::max();
+		std::vector<std::uint32_t> parents(node_count, no_parent);
+		std::vector<std::uint8_t> in_leaf(prim_count, 0);
+		std::size_t interior{ 0 };
+		for (std::size_t i = 0; i < node_count; i++) {
+			const auto& n = nodes[i];
+			if (n.is_leaf()) {
+				if (n.first > prim_count || n.count > prim_count - n.first) {
+					throw fail();
+				}
+				for (auto s = n.first; s < n.first + n.count; s++) {
+					if (in_leaf[s]) {
+						throw fail();
+					}
+					in_leaf[s] = 1;
+				}
+			}
+			else {
+				if (n.first <= i || n.first >= node_count - 1 || parents[n.first] != no_parent || parents[n.first + 1] != no_parent) {
+					throw fail();
+				}
+				parents[n.first] = parents[n.first + 1] = static_cast<std::uint32_t>(i);
+				interior++;
+			}
+		}
+		if (node_count > 0 && node_count != 2 * interior + 1) {
+			throw fail();
+		}
+		// Parents come first, so depths follow in one pass.
+		std::vector<std::uint8_t> depth(node_count, 0);
+		for (std::size_t i = 1; i < node_count; i++) {
+			if (depth[parents[i]] >= max_depth) {
+				throw fail();
+			}
+			depth[i] = static_cast<std::uint8_t>(depth[parents[i]] + 1);
+		}
+		std::vector<std::uint8_t> used(prim_count, 0);
+		for (std::uint32_t i = 0; i < prim_count; i++) {
+			if (!in_leaf[i] || prims[i] >= prim_count || used[prims[i]]) {
+				throw fail();
+			}
+			used[prims[i]] = 1;
+		}
+
+		m_nodes = std::move(nodes);
+		m_prims = std::move(prims);
+		m_parents.clear();
+		m_axes.clear();
+		if (m_keep_links) {
+			m_parents = std::move(parents);
+			if (node_count > 0) {
+				m_parents[0] = 0;
+			}
+			// Stand-in split axes: where the children's centres differ most.
+			m_axes.assign(node_count, 0);
+			for (std::size_t i = 0; i < node_count; i++) {
+				if (!m_nodes[i].is_leaf()) {
+					const auto d = m_nodes[m_nodes[i].first + 1].bounds.centroid() - m_nodes[m_nodes[i].first].bounds.centroid();
+					const vec3 a{ std::abs(d.x), std::abs(d.y), std::abs(d.z) };
+					m_axes[i] = static_cast<std::uint8_t>(a.x > a.y && a.x > a.z ? 0 : a.y > a.z ? 1 : 2);
+				}
+			}
+		}
+		m_dirty.clear();
+		m_sah_sum = sah_sum();
+		m_built_sah = tracked_sah_cost();
+	}
+
+	// Expected cost of a random ray through the tree, relative to the root:
+	// every node weighted by the probability (surface area ratio) that a ray
+	// hitting the root also hits it. Lower is better.
+	float sah_cost() const noexcept {
+		if (m_nodes.empty() || m_nodes[0].bounds.surface_area() <= 0.0f) {
+			return 0.0f;
+		}
+		return static_cast<float>(sah_sum() / m_nodes[0].bounds.surface_area());
+	}
+
+	// Recomputes every node's bounds from bounds_of after primitives have
+	// moved, keeping the topology. Leaves are refit in parallel, and each
+	// interior node is refit by whichever of its two children finishes last.
+	template <typename BoundsOf>
+	void refit(BoundsOf&& bounds_of) {
+		if (m_nodes.empty()) {
+			return;
+		}
+		link();
+		std::vector<std::atomic<std::uint8_t>> arrivals(m_nodes.size());
+		for (auto& a : arrivals) {
+			a.store(0, std::memory_order_relaxed);
+		}
+
+		const auto leaf_count = static_cast<std::int64_t>(m_leaves.size());
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (std::int64_t i = 0; i < leaf_count; i++) {
+			auto node = m_leaves[i];
+			aabb b{};
+			for (auto s = m_nodes[node].first; s < m_nodes[node].first + m_nodes[node].count; s++) {
+				b.grow(bounds_of(m_prims[s]));
+			}
+			m_nodes[node].bounds = b;
+			while (node != 0) {
+				node = m_parents[node];
+				if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0) {
+					break;
+				}
+				fit(node);
+			}
+		}
+		m_sah_sum = sah_sum();
+	}
+
+	// Refits only the leaves holding the `moved` primitives and their
+	// ancestors, so the cost follows the number of primitives that moved.
+	template <typename BoundsOf>
+	void refit(const std::vector<std::uint32_t>& moved, BoundsOf&& bounds_of) {
+		if (m_nodes.empty()) {
+			return;
+		}
+		link();
+		std::vector<std::uint32_t> dirty;
+		for (const auto prim : moved) {
+			for (auto node = m_leaf_of[m_slot_of[prim]]; !m_dirty[node]; node = m_parents[node]) {
+				m_dirty[node] = 1;
+				dirty.push_back(node);
+				if (node == 0) {
+					break;
+				}
+			}
+		}
+		// Children are always created after their parent, so refitting in
+		// descending index order visits every child before its parent.
+		std::sort(dirty.begin(), dirty.end(), std::greater<>{});
+		for (const auto node : dirty) {
+			auto& n = m_nodes[node];
+			const auto weight = n.is_leaf() ? intersect_cost * n.count : traversal_cost;
+			m_sah_sum -= n.bounds.surface_area() * weight;
+			if (n.is_leaf()) {
+				aabb b{};
+				for (auto s = n.first; s < n.first + n.count; s++) {
+					b.grow(bounds_of(m_prims[s]));
+				}
+				n.bounds = b;
+			}
+			else {
+				fit(node);
+			}
+			m_sah_sum += n.bounds.surface_area() * weight;
+			m_dirty[node] = 0;
+		}
+	}
+
+	// Refits after all primitives moved, and rebuilds instead once the SAH
+	// cost has grown past rebuild_threshold times its cost after the last
+	// build. A rebuild reassigns slots, so containers that keep primitives
+	// in slot order must reorder them when the result says rebuilt.
+	template <typename BoundsOf>
+	bvh_update_result update(BoundsOf&& bounds_of, const float rebuild_threshold = default_rebuild_threshold) {
+		refit(bounds_of);
+		return rebuild_if_degraded(bounds_of, rebuild_threshold);
+	}
+
+	// As above for a frame where only the `moved` primitives changed. Large
+	// moved sets take the parallel full refit instead of walking each path.
+	template <typename BoundsOf>
+	bvh_update_result update(const std::vector<std::uint32_t>& moved, BoundsOf&& bounds_of,
+		const float rebuild_threshold = default_rebuild_threshold) {
+		if (moved.size() * 8 > m_prims.size()) {
+			refit(bounds_of);
+		}
+		else {
+			refit(moved, bounds_of);
+		}
+		return rebuild_if_degraded(bounds_of, rebuild_threshold);
+	}
+
+	// Finds the closest primitive along r nearer than t_max. intersect(slot,
+	// t_max) must return true and shrink t_max when the primitive is hit.
+	template <typename Intersect>
+	bool closest_hit(const ray& r, float& t_max, Intersect&& intersect) const {
+		if (m_nodes.empty()) {
+			return false;
+		}
+		const bvh_ray br{ r };
+		std::uint32_t stack[max_depth + 1];
+		auto top{ 0 };
+		auto hit{ false };
+		auto node{ 0u };
+
+		if (br.enter(m_nodes[0].bounds, t_max) == std::numeric_limits<float>::infinity()) {
+			return false;
+		}
+		for (;;) {
+			const auto& n = m_nodes[node];
+			if (n.is_leaf()) {
+				for (auto i = n.first; i < n.first + n.count; i++) {
+					hit |= intersect(i, t_max);
+				}
+			}
+			else {
+				// Visit the nearer child first and defer the other.
+				auto near_child = n.first;
+				auto far_child = n.first + 1;
+				auto t_near = br.enter(m_nodes[near_child].bounds, t_max);
+				auto t_far = br.enter(m_nodes[far_child].bounds, t_max);
+				if (t_far < t_near) {
+					std::swap(near_child, far_child);
+					std::swap(t_near, t_far);
+				}
+				if (t_near != std::numeric_limits<float>::infinity()) {
+					if (t_far != std::numeric_limits<float>::infinity()) {
+						stack[top++] = far_child;
+					}
+					node = near_child;
+					continue;
+				}
+			}
+			// Pop, skipping subtrees that a closer hit has since ruled out.
+			do {
+				if (top == 0) {
+					return hit;
+				}
+				node = stack[--top];
+			} while (br.enter(m_nodes[node].bounds, t_max) == std::numeric_limits<float>::infinity());
+		}
+	}
+
+	// Returns as soon as any primitive blocks r before t_max. occludes(slot,
+	// t_max) returns whether the primitive is hit.
+	template <typename Occludes>
+	bool any_hit(const ray& r, const float t_max, Occludes&& occludes) const {
+		if (m_nodes.empty()) {
+			return false;
+		}
+		const bvh_ray br{ r };
+		std::uint32_t stack[max_depth + 1];
+		auto top{ 0 };
+		stack[top++] = 0;
+
+		while (top > 0) {
+			const auto& n = m_nodes[stack[--top]];
+			if (br.enter(n.bounds, t_max) == std::numeric_limits<float>::infinity()) {
+				continue;
+			}
+			if (n.is_leaf()) {
+				for (auto i = n.first; i < n.first + n.count; i++) {
+					if (occludes(i, t_max)) {
+						return true;
+					}
+				}
+			}
+			else {
+				stack[top++] = n.first + 1;
+				stack[top++] = n.first;
+			}
+		}
+		return false;
+	}
+
+	aabb bounds() const noexcept {
+		return m_nodes.empty() ? aabb{} : m_nodes[0].bounds;
+	}
+
+	const std::vector<bvh_node>& nodes() const noexcept {
+		return m_nodes;
+	}
+
+	const std::vector<std::uint32_t>& prim_indices() const noexcept {
+		return m_prims;
+	}
+
+	// Parent of each node, for traversals that walk back up the tree. The
+	// root is its own parent. Kept from every build only for trees made with
+	// keep_links; otherwise built by the first refit.
+	const std::vector<std::uint32_t>& parents() const noexcept {
+		return m_parents;
+	}
+
+	// For each interior node, the axis its children were split along; the
+	// first child holds the primitives with lower centres on that axis.
+	// Empty unless the tree was made with keep_links.
+	const std::vector<std::uint8_t>& split_axes() const noexcept {
+		return m_axes;
+	}
+
+	// Nodes, parent links, split axes and the primitive index array.
+	std::size_t memory_bytes() const noexcept {
+		return m_nodes.size() * sizeof(bvh_node) + m_parents.size() * sizeof(std::uint32_t) +
+			m_axes.size() * sizeof(std::uint8_t) + m_prims.size() * sizeof(std::uint32_t);
+	}
+
+protected:
+	// With keep_links, every build and assign records parents() and
+	// split_axes(), for traversals that walk back up the tree; plain trees
+	// skip both.
+	explicit bvh(const bool keep_links) noexcept
+		: m_keep_links{ keep_links }
+	{}
+
+private:
+	double sah_sum() const noexcept {
+		auto sum{ 0.0 };
+		for (const auto& node : m_nodes) {
+			sum += node.bounds.surface_area() * (node.is_leaf() ? intersect_cost * node.count : traversal_cost);
+		}
+		return sum;
+	}
+
+	// sah_cost() from the running sum kept up to date by refits.
+	float tracked_sah_cost() const noexcept {
+		if (m_nodes.empty() || m_nodes[0].bounds.surface_area() <= 0.0f) {
+			return 0.0f;
+		}
+		return static_cast<float>(m_sah_sum / m_nodes[0].bounds.surface_area());
+	}
+
+	template <typename BoundsOf>
+	bvh_update_result rebuild_if_degraded(BoundsOf&& bounds_of, const float rebuild_threshold) {
+		const auto cost = tracked_sah_cost();
+		const auto degradation = m_built_sah > 0.0f ? cost / m_built_sah : 1.0f;
+		if (degradation <= rebuild_threshold) {
+			return { false, cost, degradation };
+		}
+		build(static_cast<std::uint32_t>(m_prims.size()), bounds_of);
+		return { true, m_built_sah, 1.0f };
+	}
+
+	void fit(const std::uint32_t node) noexcept {
+		auto& n = m_nodes[node];
+		n.bounds = m_nodes[n.first].bounds;
+		n.bounds.grow(m_nodes[n.first + 1].bounds);
+	}
+
+	// Parent links and leaf and slot lookups used by refits, built on the
+	// first refit after each build.
+	void link() {
+		if (m_dirty.size() == m_nodes.size()) {
+			return;
+		}
+		m_parents.assign(m_nodes.size(), 0);
+		m_dirty.assign(m_nodes.size(), 0);
+		m_leaf_of.assign(m_prims.size(), 0);
+		m_slot_of.assign(m_prims.size(), 0);
+		m_leaves.clear();
+		for (std::uint32_t i = 0; i < m_nodes.size(); i++) {
+			const auto& n = m_nodes[i];
+			if (n.is_leaf()) {
+				m_leaves.push_back(i);
+				for (auto s = n.first; s < n.first + n.count; s++) {
+					m_leaf_of[s] = i;
+				}
+			}
+			else {
+				m_parents[n.first] = i;
+				m_parents[n.first + 1] = i;
+			}
+		}
+		for (std::uint32_t s = 0; s < m_prims.size(); s++) {
+			m_slot_of[m_prims[s]] = s;
+		}
+	}
+
+	// Primitives are partitioned as these records rather than as indices, so
+	// every pass over a node reads memory sequentially.
+	struct build_prim {
+		aabb bounds;
+		vec3 centroid;
+		std::uint32_t index;
+	};
+
+	struct build_input {
+		std::vector<build_prim> prims;
+		std::atomic<std::uint32_t> next_node;
+	};
+
+	// A node waiting to be split, with the bounds of its primitives' centroids.
+	struct build_task {
+		std::uint32_t node;
+		unsigned depth;
+		aabb centroid_bounds;
+	};
+
+	struct sah_bin {
+		aabb bounds;
+		aabb centroid_bounds;
+		std::uint32_t count{ 0 };
+	};
+
+	using bin_set = std::array<sah_bin, sah_bins>;
+
+	// Calls body(chunk, begin, end) over [first, first + count) in `chunks`
+	// pieces, on the worker threads when there is more than one.
+	template <typename Body>
+	static void for_chunks(const std::uint32_t first, const std::uint32_t count, const int chunks, Body&& body) {
+		if (chunks == 1) {
+			body(0, first, first + count);
+			return;
+		}
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+		for (auto c = 0; c < chunks; c++) {
+			body(c, static_cast<std::uint32_t>(first + std::uint64_t{ count } * c / chunks),
+				static_cast<std::uint32_t>(first + std::uint64_t{ count } * (c + 1) / chunks));
+		}
+	}
+
+	// Bounds and centroid bounds of a range of build primitives.
+	static std::pair<aabb, aabb> range_bounds(const std::uint32_t first, const std::uint32_t count,
+		const build_input& in, const int chunks) {
+		std::vector<std::pair<aabb, aabb>> partial(chunks);
+		for_chunks(first, count, chunks, [&](const int c, const std::uint32_t begin, const std::uint32_t end) {
+			for (auto i = begin; i < end; i++) {
+				partial[c].first.grow(in.prims[i].bounds);
+				partial[c].second.grow(in.prims[i].centroid);
+			}
+		});
+		for (auto c = 1; c < chunks; c++) {
+			partial[0].first.grow(partial[c].first);
+			partial[0].second.grow(partial[c].second);
+		}
+		return partial[0];
+	}
+
+	void build_subtree(const build_task& task, build_input& in) {
+		build_task children[2];
+		if (split(task, in, 1, children)) {
+			build_subtree(children[0], in);
+			build_subtree(children[1], in);
+		}
+	}
+
+	// Splits a node whose bounds are already set, creating its two children
+	// and describing them in `children`, or returns false to keep it as a
+	// leaf. Child bounds come from the bins, so no extra pass is needed.
+	bool split(const build_task& task, build_input& in, const int chunks, build_task (&children)[2]) {
+		const auto first = m_nodes[task.node].first;
+		const auto count = m_nodes[task.node].count;
+		const auto& bounds = m_nodes[task.node].bounds;
+		const auto& centroid_bounds = task.centroid_bounds;
+
+		const auto e = centroid_bounds.extent();
+		if (count <= 1 || (e.x <= 0.0f && e.y <= 0.0f && e.z <= 0.0f)) {
+			return false;
+		}
+
+		// Bins are laid out along the widest axis of the centroid bounds only,
+		// which costs a third of binning all three for a small loss in quality.
+		const auto axis = e.x > e.y && e.x > e.z ? 0 : e.y > e.z ? 1 : 2;
+		auto mid{ first };
+		std::pair<aabb, aabb> child_bounds[2];
+		if (task.depth < max_sah_depth) {
+			// Small nodes get fewer bins; sweeping all of them would cost more
+			// than binning their few primitives.
+			const auto bin_count = static_cast<int>(std::min<std::uint32_t>(sah_bins, std::max<std::uint32_t>(4, count)));
+			const auto lo = component(centroid_bounds.lo, axis);
+			const auto scale = bin_count / component(e, axis);
+			const auto bin_of = [&](const build_prim& p) {
+				return std::min(static_cast<int>((component(p.centroid, axis) - lo) * scale), bin_count - 1);
+			};
+
+			// Subtree builds run one node at a time per thread and keep their
+			// bins on the stack; only the parallel top-level splits allocate.
+			bin_set local_bins{};
+			std::vector<bin_set> shared_bins(chunks > 1 ? chunks : 0);
+			auto* bins = chunks > 1 ? shared_bins.data() : &local_bins;
+			for_chunks(first, count, chunks, [&](const int c, const std::uint32_t begin, const std::uint32_t end) {
+				for (auto i = begin; i < end; i++) {
+					const auto& p = in.prims[i];
+					auto& bin = bins[c][bin_of(p)];
+					bin.bounds.grow(p.bounds);
+					bin.centroid_bounds.grow(p.centroid);
+					bin.count++;
+				}
+			});
+			for (auto c = 1; c < chunks; c++) {
+				for (auto b = 0; b < bin_count; b++) {
+					bins[0][b].bounds.grow(bins[c][b].bounds);
+					bins[0][b].centroid_bounds.grow(bins[c][b].centroid_bounds);
+					bins[0][b].count += bins[c][b].count;
+				}
+			}
+
+			// Sweep from the right to get the cost of every split plane, then
+			// from the left to pick the cheapest.
+			const auto& merged = bins[0];
+			std::array<float, sah_bins> right_cost{};
+			aabb right{};
+			std::uint32_t right_count{ 0 };
+			for (auto b = bin_count - 1; b > 0; b--) {
+				right.grow(merged[b].bounds);
+				right_count += merged[b].count;
+				right_cost[b] = right.surface_area() * right_count;
+			}
+			auto best_cost{ std::numeric_limits<float>::max() };
+			auto best_split{ 0 };
+			aabb left{};
+			std::uint32_t left_count{ 0 };
+			for (auto b = 1; b < bin_count; b++) {
+				left.grow(merged[b - 1].bounds);
+				left_count += merged[b - 1].count;
+				if (left_count == 0 || left_count == count) {
+					continue;
+				}
+				const auto cost = left.surface_area() * left_count + right_cost[b];
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_split = b;
+				}
+			}
+
+			if (best_split > 0) {
+				best_cost = traversal_cost + intersect_cost * best_cost / bounds.surface_area();
+				if (count <= max_leaf_size && best_cost >= intersect_cost * count) {
+					return false;
+				}
+				for (auto b = 0; b < bin_count; b++) {
+					auto& side = child_bounds[b < best_split ? 0 : 1];
+					side.first.grow(merged[b].bounds);
+					side.second.grow(merged[b].centroid_bounds);
+				}
+				mid = static_cast<std::uint32_t>(std::partition(in.prims.begin() + first, in.prims.begin() + first + count,
+					[&](const build_prim& p) { return bin_of(p) < best_split; }) - in.prims.begin());
+			}
+		}
+		else if (count <= max_leaf_size) {
+			return false;
+		}
+
+		if (mid == first || mid == first + count) {
+			mid = first + count / 2;
+			std::nth_element(in.prims.begin() + first, in.prims.begin() + mid, in.prims.begin() + first + count,
+				[&](const build_prim& l, const build_prim& r) {
+					return component(l.centroid, axis) < component(r.centroid, axis);
+				});
+			child_bounds[0] = range_bounds(first, mid - first, in, chunks);
+			child_bounds[1] = range_bounds(mid, first + count - mid, in, chunks);
+		}
+
+		const auto left = in.next_node.fetch_add(2);
+		m_nodes[left] = { child_bounds[0].first, first, mid - first };
+		m_nodes[left + 1] = { child_bounds[1].first, mid, first + count - mid };
+		m_nodes[task.node].first = left;
+		m_nodes[task.node].count = 0;
+		if (m_keep_links) {
+			m_parents[left] = task.node;
+			m_parents[left + 1] = task.node;
+			m_axes[task.node] = static_cast<std::uint8_t>(axis);
+		}
+		children[0] = { left, task.depth + 1, child_bounds[0].second };
+		children[1] = { left + 1, task.depth + 1, child_bounds[1].second };
+		return true;
+	}
+
+	std::vector<bvh_node> m_nodes;
+	std::vector<std::uint32_t> m_prims;
+
+	double m_sah_sum{ 0.0 };	// unnormalized sah_cost(), kept current by refits
+	float m_built_sah{ 0.0f };
+
+	bool m_keep_links{ false };
+	std::vector<std::uint32_t> m_parents;	// by node; the root is its own parent
+	std::vector<std::uint8_t> m_axes;	// by node, see split_axes()
+	std::vector<std::uint32_t> m_leaves;
+	std::vector<std::uint32_t> m_leaf_of;	// by slot
+	std::vector<std::uint32_t> m_slot_of;	// by primitive
+	std::vector<std::uint8_t> m_dirty;
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "Bvh.h"
+#include "MappedFile.h"
+#include "WideBvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Cached bvh file: this header, then the node array and the primitive index
+// array exactly as bvh::nodes() and bvh::prim_indices() hold them, each
+// 64-byte aligned. scene_hash identifies the primitive bounds the tree was
+// built from (see bvh_cache::scene_hash), so a file for a changed scene is
+// recognised as stale; checksum covers both arrays against corruption.
+struct bvh_cache_header {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t endian_tag;	// endian_tag as written by the producing machine
+	std::uint64_t scene_hash;
+	std::uint64_t node_count;
+	std::uint64_t node_offset;	// in bytes from the start of the file
+	std::uint64_t prim_count;
+	std::uint64_t prim_offset;
+	std::uint64_t checksum;
+
+	static constexpr char expected_magic[8]{ 'R', 'T', 'B', 'V', 'H', '\0', '\0', '\0' };
+	static constexpr std::uint32_t current_version{ 1 };
+	static constexpr std::uint32_t expected_endian_tag{ 0x01020304 };
+	static constexpr std::uint64_t alignment{ 64 };
+};
+static_assert(sizeof(bvh_cache_header) == 64, "bvh_cache_header is part of the file format");
+
+namespace bvh_cache {
+	namespace detail {
+		constexpr std::uint64_t align(const std::uint64_t offset) noexcept {
+			return (offset + bvh_cache_header::alignment - 1) & ~(bvh_cache_header::alignment - 1);
+		}
+
+		// 64-bit multiply-rotate hash over whole words, with a final avalanche.
+		// Not cryptographic; it only has to tell scenes and damaged files apart.
+		class hasher {
+		public:
+			void add(const void* data, const std::size_t bytes) noexcept {
+				const auto* p = static_cast<const unsigned char*>(data);
+				std::size_t i{ 0 };
+				for (; i + 8 <= bytes; i += 8) {
+					std::uint64_t word;
+					std::memcpy(&word, p + i, sizeof(word));
+					mix(word);
+				}
+				if (i < bytes) {
+					std::uint64_t word{ 0 };
+					std::memcpy(&word, p + i, bytes - i);
+					mix(word);
+				}
+				m_length += bytes;
+			}
+
+			std::uint64_t value() const noexcept {
+				auto h = m_state ^ m_length;
+				h ^= h >> 33;
+				h *= 0xff51afd7ed558ccdull;
+				h ^= h >> 33;
+				h *= 0xc4ceb9fe1a85ec53ull;
+				h ^= h >> 33;
+				return h;
+			}
+
+		private:
+			void mix(std::uint64_t word) noexcept {
+				word *= 0x87c37b91114253d5ull;
+				word = (word << 31) | (word >> 33);
+				word *= 0x4cf5ad432745937full;
+				m_state ^= word;
+				m_state = ((m_state << 27) | (m_state >> 37)) * 5 + 0x52dce729;
+			}
+
+			std::uint64_t m_state{ 0x9e3779b97f4a7c15ull };
+			std::uint64_t m_length{ 0 };
+		};
+
+		inline std::uint64_t checksum(const bvh_node* nodes, const std::size_t node_count,
+			const std::uint32_t* prims, const std::size_t prim_count) noexcept {
+			hasher h;
+			h.add(nodes, node_count * sizeof(bvh_node));
+			h.add(prims, prim_count * sizeof(std::uint32_t));
+			return h.value();
+		}
+	} // end namespace detail
+
+	// Key for the tree over bounds_of(i), i in [0, prim_count): the bounds
+	// are all a bvh depends on, so scenes that differ only in materials or
+	// other per-primitive data share a cached tree. The builder's parameters
+	// are part of the key, so changing them invalidates existing files.
+	template <typename BoundsOf>
+	std::uint64_t scene_hash(const std::uint32_t prim_count, BoundsOf&& bounds_of) {
+		detail::hasher h;
+		const std::uint32_t params[]{ bvh::max_leaf_size, static_cast<std::uint32_t>(bvh::sah_bins), prim_count };
+		h.add(params, sizeof(params));
+		for (std::uint32_t i = 0; i < prim_count; i++) {
+			const aabb b = bounds_of(i);
+			h.add(&b, sizeof(b));
+		}
+		return h.value();
+	}
+
+	// Writes to a temporary file next to path and renames it into place, so
+	// processes sharing the cache never read a partly written file.
+	inline void write(const std::string& path, const bvh& tree, const std::uint64_t scene_hash) {
+		const auto& nodes = tree.nodes();
+		const auto& prims = tree.prim_indices();
+
+		bvh_cache_header header{};
+		std::memcpy(header.magic, bvh_cache_header::expected_magic, sizeof(header.magic));
+		header.version = bvh_cache_header::current_version;
+		header.endian_tag = bvh_cache_header::expected_endian_tag;
+		header.scene_hash = scene_hash;
+		header.node_count = nodes.size();
+		header.node_offset = detail::align(sizeof(header));
+		header.prim_count = prims.size();
+		header.prim_offset = detail::align(header.node_offset + nodes.size() * sizeof(bvh_node));
+		header.checksum = detail::checksum(nodes.data(), nodes.size(), prims.data(), prims.size());
+
+		const auto temp = path + "." + std::to_string(std::random_device{}()) + ".tmp";
+		{
+			std::ofstream out{ temp, std::ios::binary | std::ios::trunc };
+			const char padding[bvh_cache_header::alignment]{};
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(padding, header.node_offset - sizeof(header));
+			out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(bvh_node));
+			out.write(padding, header.prim_offset - (header.node_offset + nodes.size() * sizeof(bvh_node)));
+			out.write(reinterpret_cast<const char*>(prims.data()), prims.size() * sizeof(std::uint32_t));
+			if (!out.flush()) {
+				out.close();
+				std::remove(temp.c_str());
+				throw std::runtime_error{ "cannot write " + temp };
+			}
+		}
+		if (std::rename(temp.c_str(), path.c_str()) != 0) {
+			// rename() does not replace an existing file on every platform.
+			std::remove(path.c_str());
+			if (std::rename(temp.c_str(), path.c_str()) != 0) {
+				std::remove(temp.c_str());
+				throw std::runtime_error{ "cannot replace " + path };
+			}
+		}
+	}
+
+	// Reads a file written by write() straight into the arrays `tree` then
+	// takes over, so nothing is copied after the read. Throws runtime_error,
+	// leaving `tree` unchanged, when the file cannot be read, is for a
+	// different scene_hash, or fails the header, checksum or tree structure
+	// checks.
+	inline void read(const std::string& path, const std::uint64_t scene_hash, bvh& tree) {
+		const auto fail = [&path](const char* why) {
+			return std::runtime_error{ path + ": " + why };
+		};
+		std::ifstream in{ path, std::ios::binary | std::ios::ate };
+		if (!in) {
+			throw fail("cannot open");
+		}
+		const auto file_size = static_cast<std::uint64_t>(in.tellg());
+
+		if (file_size < sizeof(bvh_cache_header)) {
+			throw fail("too small to be a bvh cache file");
+		}
+		bvh_cache_header header{};
+		in.seekg(0);
+		in.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (std::memcmp(header.magic, bvh_cache_header::expected_magic, sizeof(header.magic)) != 0) {
+			throw fail("not a bvh cache file");
+		}
+		if (header.version != bvh_cache_header::current_version) {
+			throw fail("unsupported bvh cache file version");
+		}
+		if (header.endian_tag != bvh_cache_header::expected_endian_tag) {
+			throw fail("bvh cache file was written with a different byte order");
+		}
+		if (header.scene_hash != scene_hash) {
+			throw fail("bvh cache file is for a different scene");
+		}
+		if (header.prim_count > std::numeric_limits<std::uint32_t>::max() || header.node_count > 2 * header.prim_count) {
+			throw fail("bvh cache file counts are out of range");
+		}
+		if (header.node_offset % bvh_cache_header::alignment != 0 || header.prim_offset % bvh_cache_header::alignment != 0) {
+			throw fail("misaligned bvh cache arrays");
+		}
+		if (header.node_offset < sizeof(header) || !array_fits(header.node_offset, header.node_count, sizeof(bvh_node), file_size) ||
+			!array_fits(header.prim_offset, header.prim_count, sizeof(std::uint32_t), file_size) ||
+			header.prim_offset < header.node_offset || header.prim_offset - header.node_offset < header.node_count * sizeof(bvh_node)) {
+			throw fail("bvh cache arrays overrun the file");
+		}
+
+		std::vector<bvh_node> nodes(static_cast<std::size_t>(header.node_count));
+		std::vector<std::uint32_t> prims(static_cast<std::size_t>(header.prim_count));
+		in.seekg(static_cast<std::streamoff>(header.node_offset));
+		in.read(reinterpret_cast<char*>(nodes.data()), static_cast<std::streamsize>(nodes.size() * sizeof(bvh_node)));
+		in.seekg(static_cast<std::streamoff>(header.prim_offset));
+		in.read(reinterpret_cast<char*>(prims.data()), static_cast<std::streamsize>(prims.size() * sizeof(std::uint32_t)));
+		if (!in) {
+			throw fail("cannot read bvh cache arrays");
+		}
+		if (detail::checksum(nodes.data(), nodes.size(), prims.data(), prims.size()) != header.checksum) {
+			throw fail("bvh cache file is corrupt");
+		}
+		try {
+			tree.assign(std::move(nodes), std::move(prims));
+		}
+		catch (const std::invalid_argument&) {
+			throw fail("bvh cache file does not hold a valid tree");
+		}
+	}
+
+	// Loads the tree for these primitives from path, or builds it when the
+	// file is missing, stale or damaged and then stores it there for next
+	// time. Failing to store it is not an error; the tree is still built.
+	// Returns whether the tree came from the file.
+	template <typename BoundsOf>
+	bool load_or_build(bvh& tree, const std::string& path, const std::uint32_t prim_count, BoundsOf&& bounds_of,
+		bvh_build_stats* stats = nullptr) {
+		const auto start = std::chrono::steady_clock::now();
+		const auto hash = scene_hash(prim_count, bounds_of);
+		try {
+			read(path, hash, tree);
+			if (stats) {
+				stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				stats->sah_cost = tree.sah_cost();
+				stats->nodes = static_cast<std::uint32_t>(tree.nodes().size());
+				stats->leaves = static_cast<std::uint32_t>(std::count_if(tree.nodes().begin(), tree.nodes().end(),
+					[](const bvh_node& node) { return node.is_leaf(); }));
+			}
+			return true;
+		}
+		catch (const std::runtime_error&) {
+		}
+
+		tree.build(prim_count, bounds_of, stats);
+		try {
+			write(path, tree, hash);
+		}
+		catch (const std::runtime_error&) {
+		}
+		return false;
+	}
+
+	// Wide trees cache the binary tree they are collapsed from; collapsing
+	// is cheap next to building.
+	template <int N, typename BoundsOf>
+	bool load_or_build(wide_bvh<N>& tree, const std::string& path, const std::uint32_t prim_count, BoundsOf&& bounds_of,
+		bvh_build_stats* stats = nullptr) {
+		bvh binary;
+		const auto loaded = load_or_build(binary, path, prim_count, bounds_of, stats);
+		tree.collapse(binary);
+		return loaded;
+	}
+} // end namespace bvh_cache
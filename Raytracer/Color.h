@@ -25,11 +25,3 @@ struct color {
 constexpr color scale(float k, const color& v) {
 	return { k * v.r, k * v.g, k * v.b };
 }
-
-constexpr color operator+(const color& v1, const color& v2) {
-	return { v1.r + v2.r, v1.g + v2.g, v1.b + v2.b };
-}
-
-constexpr color operator*(const color& v1, const color& v2) {
-	return { v1.r * v2.r, v1.g * v2.g, v1.b * v2.b };
-}
\ No newline at end of file
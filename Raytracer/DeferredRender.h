@@ -0,0 +1,318 @@
+#pragma once
+
+#include "Raytracer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// One hit of a pixel's reflection chain: what shading it needs that does
+// not depend on the lights, plus which lights were found to be blocked.
+// The thing stands for its material.
+struct gbuffer_hit {
+	const any_thing* thing;
+	vec3 pos;
+	vec3 normal;
+	vec3 reflect_dir;
+	float reflectance;		// weight of the next level's colour
+	std::uint32_t shadowed;	// bit i set when light i is blocked, for the first 32 lights
+};
+
+// Every pixel's primary hit and the hits of its reflections, kept so that
+// lighting changes can be shaded without tracing again. Stays valid while
+// the scene's things and camera do; lights may change freely. Holds
+// max_depth + 1 levels per pixel, 60 bytes each.
+//
+// Visibility of the first 32 lights is kept too, together with where those
+// lights were, so only lights that have since moved or changed range need
+// new shadow rays. A colour change alone needs none.
+class gbuffer {
+public:
+	static constexpr std::uint32_t cached_lights{ 32 };
+
+	// Clears every pixel for a frame of this size traced to max_depth.
+	void reset(const int width, const int height, const unsigned int max_depth) {
+		if (max_depth > 254) {
+			throw std::invalid_argument{ "gbuffer stores at most 255 levels per pixel" };
+		}
+		m_width = width;
+		m_height = height;
+		m_maxDepth = max_depth;
+		m_hits.resize(static_cast<std::size_t>(width) * height * levels());
+		m_counts.assign(static_cast<std::size_t>(width) * height, 0);
+		m_lights.clear();
+	}
+
+	// Stores level `depth` of pixel (x, y); a pixel's levels come in order.
+	void record(const int x, const int y, const unsigned int depth, const gbuffer_hit& hit) noexcept {
+		const auto i = index(x, y);
+		m_hits[i * levels() + depth] = hit;
+		m_counts[i] = static_cast<std::uint8_t>(depth + 1);
+	}
+
+	// Forgets the hits of pixel (x, y) before it is traced again.
+	void clear(const int x, const int y) noexcept {
+		m_counts[index(x, y)] = 0;
+	}
+
+	// Hits of pixel (x, y), primary first; none when the primary ray escapes.
+	gbuffer_hit* hits(const int x, const int y, unsigned int& count) noexcept {
+		const auto i = index(x, y);
+		count = m_counts[i];
+		return &m_hits[i * levels()];
+	}
+
+	const gbuffer_hit* hits(const int x, const int y, unsigned int& count) const noexcept {
+		const auto i = index(x, y);
+		count = m_counts[i];
+		return &m_hits[i * levels()];
+	}
+
+	// Notes the lights that every shadowed mask is now up to date with.
+	void set_lights(const std::vector<light>& lights) {
+		m_lights.assign(lights.begin(), lights.begin() + std::min<std::size_t>(lights.size(), cached_lights));
+	}
+
+	// Mask of the cached lights whose visibility has to be traced again:
+	// those moved, with a changed range, or new since set_lights().
+	std::uint32_t stale_lights(const std::vector<light>& lights) const noexcept {
+		std::uint32_t stale{ 0 };
+		for (std::uint32_t i = 0; i < std::min<std::size_t>(lights.size(), cached_lights); i++) {
+			const auto& l = lights[i];
+			if (i >= m_lights.size() || l.pos.x != m_lights[i].pos.x || l.pos.y != m_lights[i].pos.y ||
+				l.pos.z != m_lights[i].pos.z || l.range != m_lights[i].range) {
+				stale |= 1u << i;
+			}
+		}
+		return stale;
+	}
+
+	int width() const noexcept {
+		return m_width;
+	}
+
+	int height() const noexcept {
+		return m_height;
+	}
+
+	unsigned int max_depth() const noexcept {
+		return m_maxDepth;
+	}
+
+	std::size_t memory_bytes() const noexcept {
+		return m_hits.size() * sizeof(gbuffer_hit) + m_counts.size();
+	}
+
+private:
+	std::size_t index(const int x, const int y) const noexcept {
+		return static_cast<std::size_t>(y) * m_width + x;
+	}
+
+	std::size_t levels() const noexcept {
+		return static_cast<std::size_t>(m_maxDepth) + 1;
+	}
+
+	int m_width{ 0 };
+	int m_height{ 0 };
+	unsigned int m_maxDepth{ 0 };
+	std::vector<gbuffer_hit> m_hits;	// levels() per pixel, row by row
+	std::vector<std::uint8_t> m_counts;	// hits stored per pixel
+	std::vector<light> m_lights;		// as of the last visibility update
+};
+
+namespace deferred {
+	inline constexpr int tile_size{ 16 };
+
+	namespace detail {
+		// Pixel colour from each level's natural colour, as ray_tracer::shade
+		// combines them: each level adds its reflectance times the next
+		// level's colour, from the deepest up.
+		inline color composite(const gbuffer_hit* hits, const unsigned int count, const color* natural,
+			const unsigned int max_depth) noexcept {
+			auto col = color::background();
+			for (auto depth = count; depth-- > 0;) {
+				const auto reflected = depth >= max_depth ? color::grey() : scale(hits[depth].reflectance, col);
+				col = natural[depth] + reflected;
+			}
+			return col;
+		}
+
+		// Shades the stored hits of one pixel, tracing shadow rays only for
+		// lights that are stale or past the cached ones, and records what
+		// they find.
+		template <typename Scene>
+		color shade_pixel(const ray_tracer& tracer, const Scene& scene, gbuffer_hit* hits, const unsigned int count,
+			const unsigned int max_depth, const std::uint32_t stale, occluder_cache& occluders, color* natural) {
+			for (auto depth = 0u; depth < count; depth++) {
+				auto& h = hits[depth];
+				natural[depth] = tracer.natural_color(*h.thing, h.pos, h.normal, h.reflect_dir, scene,
+					[&](const std::uint32_t light_index, const ray& shadow_ray, const float dist) {
+						const auto bit = light_index < gbuffer::cached_lights ? 1u << light_index : 0u;
+						if (bit && !(stale & bit)) {
+							return (h.shadowed & bit) != 0;
+						}
+						const auto blocked = tracer.occluded(shadow_ray, dist, scene, &occluders, light_index);
+						h.shadowed = blocked ? h.shadowed | bit : h.shadowed & ~bit;
+						return blocked;
+					});
+			}
+			return composite(hits, count, natural, max_depth);
+		}
+
+		// A ball around b, grown by a margin that covers rounding in the
+		// stored hits.
+		struct ball {
+			explicit ball(const aabb& b) noexcept
+				: centre{ b.centroid() },
+				radius{ 0.5f * mag(b.extent()) }
+			{
+				const auto reach = std::max({ std::abs(b.lo.x), std::abs(b.lo.y), std::abs(b.lo.z),
+											  std::abs(b.hi.x), std::abs(b.hi.y), std::abs(b.hi.z) });
+				radius += 1e-4f * (1.0f + reach);
+			}
+
+			// Whether the segment from a to b passes through the ball; with
+			// `open` it goes on past b for ever.
+			bool crossed(const vec3& a, const vec3& b, const bool open = false) const noexcept {
+				const vec3 d{ b - a };
+				const vec3 to{ centre - a };
+				const auto along = dot(to, d);
+				const auto len2 = dot(d, d);
+				const auto t = along <= 0.0f || len2 <= 0.0f ? 0.0f : open || along < len2 ? along / len2 : 1.0f;
+				const vec3 off{ to - t * d };
+				return dot(off, off) <= radius * radius;
+			}
+
+			vec3 centre;
+			float radius;
+		};
+
+		// Whether any ray that shaded a pixel passes through the ball: the
+		// camera and reflection rays up to their hits, or on for ever when
+		// they escape, and the shadow rays from each hit to every light in
+		// range. A thing inside it, before or after an edit, can only change
+		// the pixel if so.
+		inline bool depends_on(const vec3& eye, const vec3& primary_dir, const gbuffer_hit* hits, const unsigned int count,
+			const unsigned int max_depth, const std::vector<light>& lights, const ball& b) noexcept {
+			auto from = eye;
+			for (auto depth = 0u; depth < count; depth++) {
+				const auto& h = hits[depth];
+				if (b.crossed(from, h.pos)) {
+					return true;
+				}
+				for (const auto& l : lights) {
+					const vec3 ldis{ l.pos - h.pos };
+					if (dot(ldis, ldis) < l.range * l.range && b.crossed(h.pos, l.pos)) {
+						return true;
+					}
+				}
+				from = h.pos;
+			}
+			if (count > max_depth) {
+				return false;
+			}
+			const auto& dir = count == 0 ? primary_dir : hits[count - 1].reflect_dir;
+			return b.crossed(from, from + dir, true);
+		}
+
+		// Traces pixel (x, y) afresh, keeping its hits in g, and shades it.
+		template <typename Scene>
+		color trace_pixel(const ray_tracer& tracer, const Scene& scene, gbuffer& g, const int x, const int y,
+			occluder_cache& occluders, color* natural) {
+			g.clear(x, y);
+			tracer.for_each_hit(scene, g.width(), g.height(), x, y, [&](const unsigned int depth, const any_thing& thing,
+				const vec3& pos, const vec3& normal, const vec3& reflect_dir) {
+				g.record(x, y, depth, { &thing, pos, normal, reflect_dir, thing.get_surface().reflect(pos), 0 });
+			});
+			auto count{ 0u };
+			auto* hits = g.hits(x, y, count);
+			return shade_pixel(tracer, scene, hits, count, g.max_depth(), ~0u, occluders, natural);
+		}
+	} // end namespace detail
+
+	// Renders the frame as ray_tracer::render does, keeping every hit and
+	// its visibility in g for relight().
+	template <typename Scene, typename Canvas>
+	void render(const ray_tracer& tracer, const Scene& scene, gbuffer& g, Canvas& canvas, const int width, const int height,
+		render_context& ctx) {
+		g.reset(width, height, tracer.max_depth());
+		ctx.begin_frame();
+		ctx.for_each_tile(width, height, tile_size, [&](const tile& t, arena& scratch, render_stats& stats) {
+			auto& occluders = ctx.get_occluders(workers::index());
+			auto* natural = scratch.allocate_array<color>(g.max_depth() + 1);
+			for (auto y = t.y0; y < t.y0 + t.height; y++) {
+				for (auto x = t.x0; x < t.x0 + t.width; x++) {
+					canvas.set_pixel(x, y, detail::trace_pixel(tracer, scene, g, x, y, occluders, natural));
+				}
+			}
+			stats.primary_rays += t.width * t.height;
+		});
+		g.set_lights(ray_tracer::scene_lights(scene));
+	}
+
+	// Shades the hits kept in g with the scene's current lights, giving the
+	// image ray_tracer::render would without tracing any camera or
+	// reflection rays. Shadow rays are traced only towards lights that moved
+	// since g last saw them, or past the 32nd.
+	template <typename Scene, typename Canvas>
+	void relight(const ray_tracer& tracer, const Scene& scene, gbuffer& g, Canvas& canvas, render_context& ctx) {
+		const auto& lights = ray_tracer::scene_lights(scene);
+		const auto stale = g.stale_lights(lights);
+		ctx.begin_frame();
+		ctx.for_each_tile(g.width(), g.height(), tile_size, [&](const tile& t, arena& scratch, render_stats&) {
+			auto& occluders = ctx.get_occluders(workers::index());
+			auto* natural = scratch.allocate_array<color>(g.max_depth() + 1);
+			for (auto y = t.y0; y < t.y0 + t.height; y++) {
+				for (auto x = t.x0; x < t.x0 + t.width; x++) {
+					auto count{ 0u };
+					auto* hits = g.hits(x, y, count);
+					canvas.set_pixel(x, y, detail::shade_pixel(tracer, scene, hits, count, g.max_depth(), stale, occluders, natural));
+				}
+			}
+		});
+		g.set_lights(lights);
+	}
+
+	// After things were moved, added or removed, re-traces only the pixels
+	// whose rays pass through one of the changed boxes, which must hold
+	// each edited thing where it was and where it now is. The rest of the
+	// canvas is kept from the frame g was rendered for, so the result is
+	// what render() would give. The camera and lights must not have changed
+	// since then. Returns the number of pixels traced.
+	//
+	// Only the re-traced pixels read their things from g again, so the
+	// scene may have been rebuilt; relight() afterwards needs every thing
+	// kept in g to still be where it was, as an accelerator refit keeps it.
+	template <typename Scene, typename Canvas>
+	std::uint64_t update(const ray_tracer& tracer, const Scene& scene, gbuffer& g, Canvas& canvas,
+		const std::vector<aabb>& changed, render_context& ctx) {
+		const auto& lights = ray_tracer::scene_lights(scene);
+		std::vector<detail::ball> balls;
+		balls.reserve(changed.size());
+		for (const auto& b : changed) {
+			balls.emplace_back(b);
+		}
+		const auto& cam = scene.get_camera();
+		ctx.begin_frame();
+		ctx.for_each_tile(g.width(), g.height(), tile_size, [&](const tile& t, arena& scratch, render_stats& stats) {
+			auto& occluders = ctx.get_occluders(workers::index());
+			auto* natural = scratch.allocate_array<color>(g.max_depth() + 1);
+			for (auto y = t.y0; y < t.y0 + t.height; y++) {
+				for (auto x = t.x0; x < t.x0 + t.width; x++) {
+					auto count{ 0u };
+					auto* hits = g.hits(x, y, count);
+					const auto dir = count == 0 ? tracer.primary_dir(g.width(), g.height(), x, y, cam) : vec3{};
+					if (std::none_of(balls.begin(), balls.end(), [&](const detail::ball& b) {
+						return detail::depends_on(cam.pos, dir, hits, count, g.max_depth(), lights, b); })) {
+						continue;
+					}
+					canvas.set_pixel(x, y, detail::trace_pixel(tracer, scene, g, x, y, occluders, natural));
+					stats.primary_rays++;
+				}
+			}
+		});
+		return ctx.frame_stats().primary_rays;
+	}
+} // end namespace deferred
@@ -3,9 +3,11 @@
 #include "Surface.h"
 
 
+#include <cstdint>
 #include <optional>
 
 class any_thing;
+struct instance;
 
 struct ray {
 	vec3 start;
@@ -16,6 +18,8 @@ struct intersection {
 	const any_thing* thing_;
 	ray ray_;
 	float dist;
+	std::uint32_t prim{ 0 };	// which part of the thing was hit, for things made of many primitives
+	const instance* instance_{ nullptr };	// set when thing_ lives in an instance's object space
 };
 
 struct sphere {
@@ -33,22 +37,27 @@ struct sphere {
 		std::optional<intersection> intersect(const any_thing* pself, const ray& ray_) const {
 		
 		const vec3 eo = centre - ray_.start;
-		const auto v = dot(eo, ray_.dir);
-		auto dist{ 0.0f };
+		const auto dist = hit_distance(eo, dot(eo, eo), ray_.dir);
+		if (dist == 0.0f) {
+			return std::nullopt;
+		}
+		return intersection{ pself, ray_, dist };
+	}
 
+	// Distance along dir from a start eo short of the centre, 0 for a miss.
+	// Rays from one start can share eo and dot(eo, eo).
+	constexpr float hit_distance(const vec3& eo, const float eo2, const vec3& dir) const {
+		const auto v = dot(eo, dir);
 		if (v >= 0) {
-			const auto disc = radius2 - (dot(eo, eo) - v * v);
+			const auto disc = radius2 - (eo2 - v * v);
 			if (disc >= 0) {
-				dist = v - sqrt(disc);
+				return v - math_constexpr::sqrt(disc);
 			}
 		}
-		if (dist == 0.0f) {
-			return std::nullopt;
-		}
-		return intersection{ pself, ray_, dist };
+		return 0.0f;
 	}
 
-	constexpr vec3 get_normal(const vec3& pos) const {
+	constexpr vec3 get_normal(const vec3& pos, std::uint32_t) const {
 		return norm(pos - centre);
 	}
 
@@ -71,7 +80,7 @@ struct plane {
 		return intersection{ pself, ray_, dist };
 	}
 
-	constexpr vec3 get_normal(const vec3&) const {
+	constexpr vec3 get_normal(const vec3&, std::uint32_t) const {
 		return norm;
 	}
 
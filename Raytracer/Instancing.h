@@ -0,0 +1,144 @@
+#pragma once
+
+#include "Accelerator.h"
+#include "Thing.h"
+#include "Transform.h"
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Things sharing one object space, with a BVH over the bounded ones. Many
+// instances can reference one object_geometry without copying it.
+using object_geometry = thing_accelerator<bvh>;
+
+// Placement of an object_geometry in the world.
+struct instance {
+	affine to_world;
+	affine to_object;
+	std::uint32_t geometry;
+
+	instance(const std::uint32_t geometry, const affine& to_world)
+		: to_world{ to_world },
+		to_object{ to_world.inverse() },
+		geometry{ geometry }
+	{}
+
+	vec3 point_to_object(const vec3& p) const noexcept {
+		return to_object.point(p);
+	}
+
+	vec3 normal_to_world(const vec3& n) const noexcept {
+		return norm(to_object.transposed_vector(n));
+	}
+};
+
+// Two-level acceleration structure: a top-level BVH over instances, each
+// pointing at a shared bottom-level object_geometry. Rays are carried into
+// object space when they reach an instance, so repeated objects cost one
+// copy of their geometry plus a pair of matrices each.
+//
+// A scene exposes it to ray_tracer by forwarding intersect() and occluded():
+//
+//     std::optional<intersection> intersect(const ray& r) const { return accel.intersect(r); }
+//     bool occluded(const ray& r, float t_max) const { return accel.occluded(r, t_max); }
+class two_level_bvh {
+public:
+	std::uint32_t add_geometry(const std::vector<any_thing>& things) {
+		m_geometry.emplace_back(things);
+		return static_cast<std::uint32_t>(m_geometry.size() - 1);
+	}
+
+	void add_instance(const std::uint32_t geometry, const affine& to_world) {
+		m_instances.emplace_back(geometry, to_world);
+	}
+
+	// Builds the top level; call again after adding instances. Hits hold
+	// pointers to instances, so they are only valid until the next build.
+	void build() {
+		std::vector<instance> bounded;
+		std::vector<instance> unbounded;
+		std::vector<aabb> bounds;
+		for (const auto& inst : m_instances) {
+			const auto& geometry = m_geometry[inst.geometry];
+			if (geometry.is_bounded()) {
+				bounded.push_back(inst);
+				bounds.push_back(inst.to_world.apply(geometry.bounds()));
+			}
+			else {
+				unbounded.push_back(inst);
+			}
+		}
+		m_top.build(static_cast<std::uint32_t>(bounded.size()), [&](const std::uint32_t i) { return bounds[i]; });
+
+		m_instances.clear();
+		for (const auto i : m_top.prim_indices()) {
+			m_instances.push_back(bounded[i]);
+		}
+		m_bounded = static_cast<std::uint32_t>(m_instances.size());
+		m_instances.insert(m_instances.end(), unbounded.begin(), unbounded.end());
+	}
+
+	std::optional<intersection> intersect(const ray& r) const {
+		intersection best{};
+		const auto test = [&](const instance& inst, float& t) {
+			float len;
+			const auto local = to_object(inst, r, len);
+			auto t_local = t * len;
+			intersection isect{};
+			if (!m_geometry[inst.geometry].closest_hit(local, t_local, isect)) {
+				return false;
+			}
+			t = t_local / len;
+			best = { isect.thing_, r, t, isect.prim, &inst };
+			return true;
+		};
+
+		auto t_max{ std::numeric_limits<float>::max() };
+		auto found = m_top.closest_hit(r, t_max, [&](const std::uint32_t slot, float& t) {
+			return test(m_instances[slot], t);
+		});
+		for (auto i = m_bounded; i < m_instances.size(); i++) {
+			found |= test(m_instances[i], t_max);
+		}
+		if (!found) {
+			return std::nullopt;
+		}
+		return best;
+	}
+
+	bool occluded(const ray& r, const float t_max) const {
+		const auto test = [&](const instance& inst) {
+			float len;
+			const auto local = to_object(inst, r, len);
+			return m_geometry[inst.geometry].occluded(local, t_max * len);
+		};
+		if (m_top.any_hit(r, t_max, [&](const std::uint32_t slot, float) { return test(m_instances[slot]); })) {
+			return true;
+		}
+		for (auto i = m_bounded; i < m_instances.size(); i++) {
+			if (test(m_instances[i])) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	std::size_t instance_count() const noexcept {
+		return m_instances.size();
+	}
+
+private:
+	// Object-space rays are renormalized for the primitives, so distances
+	// are rescaled by len on the way in and out.
+	static ray to_object(const instance& inst, const ray& r, float& len) noexcept {
+		const auto d = inst.to_object.vector(r.dir);
+		len = mag(d);
+		return { inst.to_object.point(r.start), (1.0f / len) * d };
+	}
+
+	std::vector<object_geometry> m_geometry;
+	std::vector<instance> m_instances;	// bounded instances in top-level slot order, then unbounded ones
+	std::uint32_t m_bounded{ 0 };
+	bvh m_top;
+};
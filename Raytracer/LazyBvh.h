@@ -0,0 +1,330 @@
+#pragma once
+
+#include "Bvh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+// Binary BVH built as rays reach it. build() only gathers the primitive
+// bounds into a root node; a node is split, with the same binned surface
+// area heuristic as bvh, the first time a traversal needs its children.
+// Renders that only see part of a large scene build only that part, and the
+// first rays cost about two passes over the primitives instead of a full
+// build. Renders that see most of the scene, or many frames of it, should
+// use bvh instead: they split nearly every node anyway, one at a time with
+// threads waiting on each other, into a tree slower to trace than bvh's.
+//
+// Same interface as bvh, except that expansion keeps reordering primitives,
+// so slots are primitive indices and prim_indices() is the identity.
+// Queries may run concurrently; the first thread to reach an unsplit node
+// splits it while others needing it wait.
+class lazy_bvh {
+public:
+	static constexpr std::uint32_t max_leaf_size{ bvh::max_leaf_size };
+	static constexpr int sah_bins{ bvh::sah_bins };
+	static constexpr unsigned max_sah_depth{ bvh::max_sah_depth };	// deeper nodes split at the median
+	static constexpr unsigned max_depth{ bvh::max_depth };	// so no node is deeper than this
+
+	lazy_bvh() = default;
+	lazy_bvh(const lazy_bvh&) = delete;
+	lazy_bvh& operator=(const lazy_bvh&) = delete;
+
+	template <typename BoundsOf>
+	void build(const std::uint32_t prim_count, BoundsOf&& bounds_of, bvh_build_stats* stats = nullptr) {
+		const auto start = std::chrono::steady_clock::now();
+		m_prims.resize(prim_count);
+		m_slots.resize(prim_count);
+		const auto n = static_cast<std::int64_t>(prim_count);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (std::int64_t i = 0; i < n; i++) {
+			const auto b = bounds_of(static_cast<std::uint32_t>(i));
+			m_prims[i] = { b, b.centroid(), static_cast<std::uint32_t>(i) };
+			m_slots[i] = static_cast<std::uint32_t>(i);
+		}
+
+		// Expansion claims sibling pairs from one array sized for the full
+		// tree; untouched nodes are never written, so cost only address space.
+		const auto capacity = prim_count == 0 ? std::size_t{ 0 } : 2 * static_cast<std::size_t>(prim_count) - 1;
+		m_nodes.reset(capacity == 0 ? nullptr : new node_storage[capacity]);
+		m_state.reset(capacity == 0 ? nullptr : new std::atomic<std::uint8_t>[capacity]);
+		m_depth.reset(capacity == 0 ? nullptr : new std::uint8_t[capacity]);
+		m_next_node.store(1, std::memory_order_relaxed);
+		if (capacity > 0) {
+			aabb root{};
+			for (const auto& p : m_prims) {
+				root.grow(p.bounds);
+			}
+			new (&m_nodes[0]) bvh_node{ root, 0, prim_count };
+			m_state[0].store(unsplit, std::memory_order_release);
+			m_depth[0] = 0;
+		}
+
+		if (stats) {
+			stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			stats->sah_cost = 0.0f;
+			stats->nodes = capacity > 0 ? 1 : 0;
+			stats->leaves = 0;
+		}
+	}
+
+	// As bvh::closest_hit, splitting nodes on the way as needed.
+	template <typename Intersect>
+	bool closest_hit(const ray& r, float& t_max, Intersect&& intersect) const {
+		if (!m_nodes) {
+			return false;
+		}
+		const bvh_ray br{ r };
+		std::uint32_t stack[max_depth + 1];
+		auto top{ 0 };
+		auto hit{ false };
+		auto node{ 0u };
+
+		if (br.enter(node_at(0).bounds, t_max) == std::numeric_limits<float>::infinity()) {
+			return false;
+		}
+		for (;;) {
+			const auto& n = expanded(node);
+			if (n.is_leaf()) {
+				for (auto i = n.first; i < n.first + n.count; i++) {
+					hit |= intersect(m_prims[i].index, t_max);
+				}
+			}
+			else {
+				// Visit the nearer child first and defer the other.
+				auto near_child = n.first;
+				auto far_child = n.first + 1;
+				auto t_near = br.enter(node_at(near_child).bounds, t_max);
+				auto t_far = br.enter(node_at(far_child).bounds, t_max);
+				if (t_far < t_near) {
+					std::swap(near_child, far_child);
+					std::swap(t_near, t_far);
+				}
+				if (t_near != std::numeric_limits<float>::infinity()) {
+					if (t_far != std::numeric_limits<float>::infinity()) {
+						stack[top++] = far_child;
+					}
+					node = near_child;
+					continue;
+				}
+			}
+			// Pop, skipping subtrees that a closer hit has since ruled out.
+			do {
+				if (top == 0) {
+					return hit;
+				}
+				node = stack[--top];
+			} while (br.enter(node_at(node).bounds, t_max) == std::numeric_limits<float>::infinity());
+		}
+	}
+
+	template <typename Occludes>
+	bool any_hit(const ray& r, const float t_max, Occludes&& occludes) const {
+		if (!m_nodes) {
+			return false;
+		}
+		const bvh_ray br{ r };
+		std::uint32_t stack[max_depth + 1];
+		auto top{ 0 };
+		stack[top++] = 0;
+
+		while (top > 0) {
+			const auto node = stack[--top];
+			if (br.enter(node_at(node).bounds, t_max) == std::numeric_limits<float>::infinity()) {
+				continue;
+			}
+			const auto& n = expanded(node);
+			if (n.is_leaf()) {
+				for (auto i = n.first; i < n.first + n.count; i++) {
+					if (occludes(m_prims[i].index, t_max)) {
+						return true;
+					}
+				}
+			}
+			else {
+				stack[top++] = n.first + 1;
+				stack[top++] = n.first;
+			}
+		}
+		return false;
+	}
+
+	aabb bounds() const noexcept {
+		return m_nodes ? node_at(0).bounds : aabb{};
+	}
+
+	// Identity: slots are primitive indices.
+	const std::vector<std::uint32_t>& prim_indices() const noexcept {
+		return m_slots;
+	}
+
+	// Nodes created so far, which grows as rays explore the scene.
+	std::uint32_t node_count() const noexcept {
+		return m_nodes ? m_next_node.load(std::memory_order_relaxed) : 0;
+	}
+
+	// Primitive records plus the nodes created so far.
+	std::size_t memory_bytes() const noexcept {
+		return m_prims.size() * (sizeof(build_prim) + sizeof(std::uint32_t)) +
+			static_cast<std::size_t>(node_count()) * (sizeof(bvh_node) + 2);
+	}
+
+private:
+	enum : std::uint8_t { unsplit, splitting, ready };
+
+	// Uninitialised storage for one node, so that allocating the node array
+	// does not touch it.
+	struct node_storage {
+		alignas(bvh_node) unsigned char bytes[sizeof(bvh_node)];
+	};
+
+	struct build_prim {
+		aabb bounds;
+		vec3 centroid;
+		std::uint32_t index;
+	};
+
+	struct sah_bin {
+		aabb bounds;
+		std::uint32_t count{ 0 };
+	};
+
+	bvh_node& node_at(const std::uint32_t i) const noexcept {
+		return *reinterpret_cast<bvh_node*>(&m_nodes[i]);
+	}
+
+	// The node with its children created, splitting it first if no thread
+	// has yet. A node's bounds are final when it is created; its first and
+	// count may only be read through here.
+	const bvh_node& expanded(const std::uint32_t node) const {
+		auto& state = m_state[node];
+		if (state.load(std::memory_order_acquire) != ready) {
+			auto expected{ static_cast<std::uint8_t>(unsplit) };
+			if (state.compare_exchange_strong(expected, splitting, std::memory_order_acquire)) {
+				split(node);
+				state.store(ready, std::memory_order_release);
+			}
+			else {
+				while (state.load(std::memory_order_acquire) != ready) {
+					std::this_thread::yield();
+				}
+			}
+		}
+		return node_at(node);
+	}
+
+	// Splits a node over its primitive range in place, or leaves it a leaf.
+	// Only this node's range is reordered, so concurrent splits of other
+	// nodes do not interfere.
+	void split(const std::uint32_t node) const {
+		auto& n = node_at(node);
+		const auto first = n.first;
+		const auto count = n.count;
+		if (count <= 1) {
+			return;
+		}
+		aabb centroid_bounds{};
+		for (auto i = first; i < first + count; i++) {
+			centroid_bounds.grow(m_prims[i].centroid);
+		}
+		const auto e = centroid_bounds.extent();
+		const auto axis = e.x > e.y && e.x > e.z ? 0 : e.y > e.z ? 1 : 2;
+		const auto lo = component(centroid_bounds.lo, axis);
+		const auto extent = component(e, axis);
+		const auto begin = m_prims.begin() + first;
+		const auto end = begin + count;
+
+		auto mid = first;
+		aabb child_bounds[2];
+		if (extent > 0.0f && m_depth[node] < max_sah_depth) {
+			const auto bin_count = static_cast<int>(std::min<std::uint32_t>(sah_bins, std::max<std::uint32_t>(4, count)));
+			const auto scale = bin_count / extent;
+			const auto bin_of = [&](const build_prim& p) {
+				return std::min(static_cast<int>((component(p.centroid, axis) - lo) * scale), bin_count - 1);
+			};
+			sah_bin bins[sah_bins];
+			for (auto it = begin; it != end; ++it) {
+				auto& b = bins[bin_of(*it)];
+				b.bounds.grow(it->bounds);
+				b.count++;
+			}
+
+			float right_cost[sah_bins];
+			aabb right{};
+			std::uint32_t right_count{ 0 };
+			for (auto b = bin_count - 1; b > 0; b--) {
+				right.grow(bins[b].bounds);
+				right_count += bins[b].count;
+				right_cost[b] = right.surface_area() * right_count;
+			}
+			auto best_cost{ std::numeric_limits<float>::infinity() };
+			auto best_split{ 0 };
+			aabb left{};
+			std::uint32_t left_count{ 0 };
+			for (auto b = 1; b < bin_count; b++) {
+				left.grow(bins[b - 1].bounds);
+				left_count += bins[b - 1].count;
+				if (left_count == 0 || left_count == count) {
+					continue;
+				}
+				const auto cost = left.surface_area() * left_count + right_cost[b];
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_split = b;
+				}
+			}
+
+			if (best_split > 0) {
+				best_cost = bvh::traversal_cost + bvh::intersect_cost * best_cost / n.bounds.surface_area();
+				if (count <= max_leaf_size && best_cost >= bvh::intersect_cost * count) {
+					return;
+				}
+				for (auto b = 0; b < bin_count; b++) {
+					child_bounds[b < best_split ? 0 : 1].grow(bins[b].bounds);
+				}
+				mid = static_cast<std::uint32_t>(std::partition(begin, end,
+					[&](const build_prim& p) { return bin_of(p) < best_split; }) - m_prims.begin());
+			}
+		}
+		else if (count <= max_leaf_size) {
+			return;
+		}
+
+		if (mid == first || mid == first + count) {
+			mid = first + count / 2;
+			std::nth_element(begin, m_prims.begin() + mid, end, [&](const build_prim& l, const build_prim& r) {
+				return component(l.centroid, axis) < component(r.centroid, axis);
+			});
+			child_bounds[0] = {};
+			child_bounds[1] = {};
+			for (auto i = first; i < first + count; i++) {
+				child_bounds[i < mid ? 0 : 1].grow(m_prims[i].bounds);
+			}
+		}
+
+		const auto left = m_next_node.fetch_add(2, std::memory_order_relaxed);
+		for (auto c = 0u; c < 2; c++) {
+			new (&m_nodes[left + c]) bvh_node{ child_bounds[c], c == 0 ? first : mid, c == 0 ? mid - first : first + count - mid };
+			m_state[left + c].store(unsplit, std::memory_order_relaxed);
+			m_depth[left + c] = static_cast<std::uint8_t>(m_depth[node] + 1);
+		}
+		n.first = left;
+		n.count = 0;
+	}
+
+	// Queries split nodes, so everything they change is mutable.
+	mutable std::vector<build_prim> m_prims;	// reordered within each node's range as it splits
+	std::vector<std::uint32_t> m_slots;
+	std::unique_ptr<node_storage[]> m_nodes;
+	std::unique_ptr<std::atomic<std::uint8_t>[]> m_state;
+	std::unique_ptr<std::uint8_t[]> m_depth;
+	mutable std::atomic<std::uint32_t> m_next_node{ 0 };
+};
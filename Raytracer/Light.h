@@ -0,0 +1,26 @@
+#pragma once
+
+#include "vec3.h"
+#include "Color.h"
+
+#include <limits>
+
+// Point light. A light with a finite range fades out smoothly towards it
+// and has no effect beyond; by default lights reach everywhere unchanged.
+struct light {
+	vec3 pos;
+	color col;
+	float range{ std::numeric_limits<float>::infinity() };
+};
+
+// Fraction of a light's colour reaching distance dist: 1 near the light,
+// easing to 0 at its range, and exactly 1 everywhere for unlimited lights.
+// Decreasing in dist and increasing in range, so bounding both bounds it.
+constexpr float light_falloff(const float dist, const float range) noexcept {
+	if (dist >= range) {
+		return 0.0f;
+	}
+	const auto x = dist / range;
+	const auto w = 1.0f - x * x;
+	return w * w;
+}
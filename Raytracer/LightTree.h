@@ -0,0 +1,161 @@
+#pragma once
+
+#include "Bvh.h"
+#include "Light.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Distance from p to the nearest point of b, 0 inside it.
+inline float distance(const aabb& b, const vec3& p) noexcept {
+	const vec3 nearest{ std::clamp(p.x, b.lo.x, b.hi.x), std::clamp(p.y, b.lo.y, b.hi.y), std::clamp(p.z, b.lo.z, b.hi.z) };
+	return mag(p - nearest);
+}
+
+// Whether l reaches some point of box.
+inline bool light_reaches(const light& l, const aabb& box) noexcept {
+	return std::isinf(l.range) || distance(box, l.pos) < l.range;
+}
+
+// Hierarchy over a scene's lights, so that shading a point only visits the
+// lights that can reach it. Lights with a finite range are kept in a bvh
+// over the boxes they reach; each node also bounds its lights' positions,
+// ranges and brightness. A point outside a node's box is out of reach of
+// all its lights, and with a cull threshold a node is also skipped when
+// even its brightest light, at its largest range and from the nearest
+// position, would give less than the threshold there. Unlimited lights
+// cannot be culled and are always visited.
+//
+// A scene exposes it to ray_tracer through
+//     const light_tree& get_light_tree() const;
+// which then shades with the lights visited instead of all of get_lights().
+class light_tree {
+public:
+	light_tree() = default;
+
+	// cull_threshold is the largest contribution, per colour channel and
+	// before surface reflectance, that may be dropped per light: 0 keeps
+	// every light in range, 1/512 drops those below display precision.
+	explicit light_tree(std::vector<light> lights, const float cull_threshold = 0.0f)
+		: m_lights{ std::move(lights) },
+		m_threshold{ cull_threshold }
+	{
+		std::vector<std::uint32_t> bounded;
+		for (std::uint32_t i = 0; i < m_lights.size(); i++) {
+			(std::isinf(m_lights[i].range) ? m_unbounded : bounded).push_back(i);
+		}
+		m_tree.build(static_cast<std::uint32_t>(bounded.size()), [&](const std::uint32_t i) {
+			const auto& l = m_lights[bounded[i]];
+			const vec3 r{ l.range, l.range, l.range };
+			return aabb{ l.pos - r, l.pos + r };
+		});
+		for (const auto prim : m_tree.prim_indices()) {
+			m_bounded.push_back(bounded[prim]);
+		}
+
+		// Children follow their parents, so one backward pass sums subtrees.
+		const auto& nodes = m_tree.nodes();
+		m_info.resize(nodes.size());
+		for (auto i = nodes.size(); i-- > 0;) {
+			auto& info = m_info[i];
+			if (nodes[i].is_leaf()) {
+				for (auto s = nodes[i].first; s < nodes[i].first + nodes[i].count; s++) {
+					const auto& l = m_lights[m_bounded[s]];
+					info.positions.grow(l.pos);
+					info.max_range = std::max(info.max_range, l.range);
+					info.max_intensity = std::max(info.max_intensity, intensity(l));
+				}
+			}
+			else {
+				for (auto c = nodes[i].first; c < nodes[i].first + 2; c++) {
+					info.positions.grow(m_info[c].positions);
+					info.max_range = std::max(info.max_range, m_info[c].max_range);
+					info.max_intensity = std::max(info.max_intensity, m_info[c].max_intensity);
+				}
+			}
+		}
+	}
+
+	// Calls f(light, index) for each light that can reach pos, index being
+	// its position in the list given. Unlimited lights come first, in list
+	// order; the order of the rest is unspecified.
+	template <typename F>
+	void for_each_reaching(const vec3& pos, F&& f) const {
+		for_each_reaching(aabb{ pos, pos }, f);
+	}
+
+	// Likewise for the lights that can reach some point of box.
+	template <typename F>
+	void for_each_reaching(const aabb& box, F&& f) const {
+		for (const auto i : m_unbounded) {
+			f(m_lights[i], i);
+		}
+		const auto& nodes = m_tree.nodes();
+		if (nodes.empty()) {
+			return;
+		}
+		std::uint32_t stack[bvh::max_depth + 1];
+		auto top{ 0 };
+		stack[top++] = 0;
+		while (top > 0) {
+			const auto node = stack[--top];
+			const auto& n = nodes[node];
+			if (!overlaps(n.bounds, box) || negligible(m_info[node], box)) {
+				continue;
+			}
+			if (n.is_leaf()) {
+				for (auto s = n.first; s < n.first + n.count; s++) {
+					const auto& l = m_lights[m_bounded[s]];
+					const auto dist = distance(box, l.pos);
+					if (dist < l.range && intensity(l) * light_falloff(dist, l.range) >= m_threshold) {
+						f(l, m_bounded[s]);
+					}
+				}
+			}
+			else {
+				stack[top++] = n.first + 1;
+				stack[top++] = n.first;
+			}
+		}
+	}
+
+	const std::vector<light>& lights() const noexcept {
+		return m_lights;
+	}
+
+private:
+	struct node_info {
+		aabb positions;
+		float max_range{ 0.0f };
+		float max_intensity{ 0.0f };
+	};
+
+	static float intensity(const light& l) noexcept {
+		return std::max({ l.col.r, l.col.g, l.col.b });
+	}
+
+	static bool overlaps(const aabb& a, const aabb& b) noexcept {
+		return a.lo.x <= b.hi.x && a.lo.y <= b.hi.y && a.lo.z <= b.hi.z && b.lo.x <= a.hi.x && b.lo.y <= a.hi.y && b.lo.z <= a.hi.z;
+	}
+
+	// Whether every light under a node gives less than the threshold
+	// throughout box.
+	bool negligible(const node_info& info, const aabb& box) const noexcept {
+		if (m_threshold <= 0.0f) {
+			return false;
+		}
+		const vec3 gap{ std::max({ 0.0f, box.lo.x - info.positions.hi.x, info.positions.lo.x - box.hi.x }),
+						std::max({ 0.0f, box.lo.y - info.positions.hi.y, info.positions.lo.y - box.hi.y }),
+						std::max({ 0.0f, box.lo.z - info.positions.hi.z, info.positions.lo.z - box.hi.z }) };
+		return info.max_intensity * light_falloff(mag(gap), info.max_range) < m_threshold;
+	}
+
+	std::vector<light> m_lights;
+	float m_threshold{ 0.0f };
+	std::vector<std::uint32_t> m_unbounded;	// indices of lights with unlimited range
+	std::vector<std::uint32_t> m_bounded;	// index of the light in each tree slot
+	bvh m_tree;
+	std::vector<node_info> m_info;	// by tree node
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+// Read-only view of a whole file mapped into memory. Pages are faulted in on
+// first access, so opening even very large files is cheap.
+class mapped_file {
+public:
+	explicit mapped_file(const std::string& path) {
+#ifdef _WIN32
+		const auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error{ "cannot open " + path };
+		}
+		LARGE_INTEGER size{};
+		GetFileSizeEx(file, &size);
+		m_size = static_cast<std::size_t>(size.QuadPart);
+		if (m_size > 0) {
+			const auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping) {
+				m_data = static_cast<const std::byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				CloseHandle(mapping);
+			}
+		}
+		CloseHandle(file);
+#else
+		const auto fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::runtime_error{ "cannot open " + path };
+		}
+		struct stat st {};
+		fstat(fd, &st);
+		m_size = static_cast<std::size_t>(st.st_size);
+		if (m_size > 0) {
+			const auto p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				m_data = static_cast<const std::byte*>(p);
+			}
+		}
+		close(fd);
+#endif
+		if (m_size > 0 && !m_data) {
+			throw std::runtime_error{ "cannot map " + path };
+		}
+	}
+
+	~mapped_file() {
+		unmap();
+	}
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	mapped_file(mapped_file&& other) noexcept
+		: m_data{ std::exchange(other.m_data, nullptr) },
+		m_size{ std::exchange(other.m_size, 0) }
+	{}
+
+	mapped_file& operator=(mapped_file&& other) noexcept {
+		if (this != &other) {
+			unmap();
+			m_data = std::exchange(other.m_data, nullptr);
+			m_size = std::exchange(other.m_size, 0);
+		}
+		return *this;
+	}
+
+	const std::byte* data() const noexcept { return m_data; }
+	std::size_t size() const noexcept { return m_size; }
+
+private:
+	void unmap() noexcept {
+		if (!m_data) {
+			return;
+		}
+#ifdef _WIN32
+		UnmapViewOfFile(m_data);
+#else
+		munmap(const_cast<std::byte*>(m_data), m_size);
+#endif
+		m_data = nullptr;
+	}
+
+	const std::byte* m_data{ nullptr };
+	std::size_t m_size{ 0 };
+};
+
+// Whether count elements of elem_size bytes starting offset bytes into a
+// file of file_size bytes lie within it, checked without any sum or
+// product that could wrap.
+constexpr bool array_fits(const std::uint64_t offset, const std::uint64_t count, const std::uint64_t elem_size,
+	const std::uint64_t file_size) noexcept {
+	return offset <= file_size && count <= (file_size - offset) / elem_size;
+}
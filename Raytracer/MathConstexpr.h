@@ -2,6 +2,7 @@
 
 #include "Defines.h"
 
+#include <cmath>
 #include <cstdint>
 
 namespace math_constexpr {
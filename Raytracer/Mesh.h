@@ -0,0 +1,200 @@
+#pragma once
+
+#include "Bvh.h"
+#include "BvhCache.h"
+
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Triangle preprocessed for Baldwin-Weber intersection: an affine transform
+// that maps the triangle onto the unit triangle in the xy-plane, so a hit
+// costs one plane distance and two dot products for the barycentrics.
+struct mesh_triangle {
+	float b1[4];	// row giving the barycentric weight of the second vertex
+	float b2[4];	// row giving the barycentric weight of the third vertex
+	float plane[4];	// row giving the scaled distance from the triangle's plane
+	std::uint32_t index;	// triangle in the mesh's index buffer
+
+	static mesh_triangle make(const vec3& v0, const vec3& v1, const vec3& v2, const std::uint32_t index) {
+		const auto e1 = v1 - v0;
+		const auto e2 = v2 - v0;
+		const auto n = cross(e1, e2);
+		const auto c1 = cross(v1, v0);
+		const auto c2 = cross(v2, v0);
+		const auto num = dot(n, v0);
+
+		const auto ax = std::abs(n.x);
+		const auto ay = std::abs(n.y);
+		const auto az = std::abs(n.z);
+		if (ax > ay && ax > az) {
+			return { { 0.0f, e2.z / n.x, -e2.y / n.x, c2.x / n.x },
+					 { 0.0f, -e1.z / n.x, e1.y / n.x, -c1.x / n.x },
+					 { 1.0f, n.y / n.x, n.z / n.x, -num / n.x }, index };
+		}
+		if (ay > az) {
+			return { { -e2.z / n.y, 0.0f, e2.x / n.y, c2.y / n.y },
+					 { e1.z / n.y, 0.0f, -e1.x / n.y, -c1.y / n.y },
+					 { n.x / n.y, 1.0f, n.z / n.y, -num / n.y }, index };
+		}
+		return { { e2.y / n.z, -e2.x / n.z, 0.0f, c2.z / n.z },
+				 { -e1.y / n.z, e1.x / n.z, 0.0f, -c1.z / n.z },
+				 { n.x / n.z, n.y / n.z, 1.0f, -num / n.z }, index };
+	}
+
+	// Shrinks t_max and returns true for a hit in (t_min, t_max).
+	constexpr bool intersect(const ray& r, const float t_min, float& t_max) const noexcept {
+		const auto t_o = plane[0] * r.start.x + plane[1] * r.start.y + plane[2] * r.start.z + plane[3];
+		const auto t_d = plane[0] * r.dir.x + plane[1] * r.dir.y + plane[2] * r.dir.z;
+		const auto t = -t_o / t_d;
+		if (!(t > t_min && t < t_max)) {
+			return false;
+		}
+		const auto p = (t * r.dir) + r.start;
+		const auto u = b1[0] * p.x + b1[1] * p.y + b1[2] * p.z + b1[3];
+		const auto v = b2[0] * p.x + b2[1] * p.y + b2[2] * p.z + b2[3];
+		if (u < 0.0f || v < 0.0f || u + v > 1.0f) {
+			return false;
+		}
+		t_max = t;
+		return true;
+	}
+};
+
+static_assert(sizeof(vec3) == 3 * sizeof(float), "vertex buffers are read as packed float triples");
+
+// Vertex and index arrays used in place by a triangle_mesh, along with
+// whatever keeps them alive: vectors, a mapped file, ...
+struct mesh_buffers {
+	const vec3* vertices{ nullptr };
+	std::size_t vertex_count{ 0 };
+	const std::uint32_t* indices{ nullptr };	// three per triangle
+	std::size_t index_count{ 0 };
+	std::shared_ptr<const void> owner;
+
+	static mesh_buffers owning(std::vector<vec3> vertices, std::vector<std::uint32_t> indices) {
+		struct storage {
+			std::vector<vec3> vertices;
+			std::vector<std::uint32_t> indices;
+		};
+		auto s = std::make_shared<const storage>(storage{ std::move(vertices), std::move(indices) });
+		return { s->vertices.data(), s->vertices.size(), s->indices.data(), s->indices.size(), s };
+	}
+};
+
+// Indexed triangle mesh with its own BVH. Mesh data is shared between copies,
+// so any_thing can hold a mesh by value without duplicating the geometry.
+class triangle_mesh {
+public:
+	// Hits closer than this are taken to be the surface the ray left from.
+	static constexpr float self_hit_epsilon{ 1e-4f };
+
+	// Throws std::invalid_argument unless every index names a vertex.
+	triangle_mesh(std::vector<vec3> vertices, std::vector<std::uint32_t> indices, const surface& surface_)
+		: triangle_mesh{ checked_buffers(std::move(vertices), std::move(indices)), surface_ }
+	{}
+
+	// Uses the buffers in place; nothing is copied out of them, nor are the
+	// indices checked. Throws std::invalid_argument unless there are whole
+	// triangles, fewer than 2^32 of them. With a bvh_cache_path the tree is
+	// loaded from that bvh cache file when it matches the triangles, and
+	// stored there otherwise (see bvh_cache::load_or_build).
+	triangle_mesh(mesh_buffers buffers, const surface& surface_, const std::string& bvh_cache_path = {})
+		: m_data{ std::make_shared<mesh_data>(std::move(buffers), bvh_cache_path) },
+		m_surface{ surface_ }
+	{}
+
+	std::optional<intersection> intersect(const any_thing* pself, const ray& ray_) const {
+		auto t_max{ std::numeric_limits<float>::max() };
+		std::uint32_t hit_slot{ 0 };
+		const auto& tris = m_data->triangles;
+		const auto hit = m_data->accel.closest_hit(ray_, t_max, [&](const std::uint32_t slot, float& t) {
+			if (tris[slot].intersect(ray_, self_hit_epsilon, t)) {
+				hit_slot = slot;
+				return true;
+			}
+			return false;
+		});
+		if (!hit) {
+			return std::nullopt;
+		}
+		return intersection{ pself, ray_, t_max, tris[hit_slot].index };
+	}
+
+	// Geometric normal of triangle prim, following its winding.
+	vec3 get_normal(const vec3&, const std::uint32_t prim) const {
+		const auto& b = m_data->buffers;
+		const auto& v0 = b.vertices[b.indices[3 * prim]];
+		const auto& v1 = b.vertices[b.indices[3 * prim + 1]];
+		const auto& v2 = b.vertices[b.indices[3 * prim + 2]];
+		return norm(cross(v1 - v0, v2 - v0));
+	}
+
+	constexpr const surface& get_surface() const {
+		return m_surface;
+	}
+
+	std::size_t triangle_count() const noexcept {
+		return m_data->triangles.size();
+	}
+
+	aabb bounds() const noexcept {
+		return m_data->accel.bounds();
+	}
+
+private:
+	static mesh_buffers checked_buffers(std::vector<vec3> vertices, std::vector<std::uint32_t> indices) {
+		for (const auto i : indices) {
+			if (i >= vertices.size()) {
+				throw std::invalid_argument{ "mesh index out of range" };
+			}
+		}
+		return mesh_buffers::owning(std::move(vertices), std::move(indices));
+	}
+
+	struct mesh_data {
+		mesh_buffers buffers;
+		std::vector<mesh_triangle> triangles;	// in BVH slot order
+		bvh accel;
+
+		mesh_data(mesh_buffers buffers_, const std::string& bvh_cache_path)
+			: buffers{ std::move(buffers_) }
+		{
+			if (buffers.index_count % 3 != 0) {
+				throw std::invalid_argument{ "mesh index count is not a multiple of three" };
+			}
+			if (buffers.index_count / 3 >= std::uint64_t{ 1 } << 32) {
+				throw std::invalid_argument{ "mesh has too many triangles for 32-bit indices" };
+			}
+			const auto* vertices = buffers.vertices;
+			const auto* indices = buffers.indices;
+			const auto count = static_cast<std::uint32_t>(buffers.index_count / 3);
+			const auto bounds_of = [&](const std::uint32_t i) {
+				aabb b{};
+				b.grow(vertices[indices[3 * i]]);
+				b.grow(vertices[indices[3 * i + 1]]);
+				b.grow(vertices[indices[3 * i + 2]]);
+				return b;
+			};
+			if (bvh_cache_path.empty()) {
+				accel.build(count, bounds_of);
+			}
+			else {
+				bvh_cache::load_or_build(accel, bvh_cache_path, count, bounds_of);
+			}
+
+			triangles.reserve(count);
+			for (const auto i : accel.prim_indices()) {
+				triangles.push_back(mesh_triangle::make(vertices[indices[3 * i]], vertices[indices[3 * i + 1]],
+					vertices[indices[3 * i + 2]], i));
+			}
+		}
+	};
+
+	std::shared_ptr<const mesh_data> m_data;
+	surface m_surface;
+};
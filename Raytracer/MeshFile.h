@@ -0,0 +1,160 @@
+#pragma once
+
+#include "MappedFile.h"
+#include "Mesh.h"
+#include "MeshImport.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+// Binary mesh file: this header, then the vertex array (packed float
+// triples) and the index array (three uint32 per triangle). Both arrays are
+// stored exactly as triangle_mesh reads them and 64-byte aligned, so a
+// mapping of the file is used as the mesh's buffers with no parsing or copy.
+struct mesh_file_header {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t endian_tag;	// endian_tag as written by the producing machine
+	std::uint64_t vertex_count;
+	std::uint64_t index_count;
+	std::uint64_t vertex_offset;	// in bytes from the start of the file
+	std::uint64_t index_offset;
+	std::uint64_t reserved[2];
+
+	static constexpr char expected_magic[8]{ 'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0' };
+	static constexpr std::uint32_t current_version{ 1 };
+	static constexpr std::uint32_t expected_endian_tag{ 0x01020304 };
+	static constexpr std::uint64_t alignment{ 64 };
+};
+static_assert(sizeof(mesh_file_header) == 64, "mesh_file_header is part of the file format");
+
+namespace mesh_file {
+	namespace detail {
+		constexpr std::uint64_t align(const std::uint64_t offset) noexcept {
+			return (offset + mesh_file_header::alignment - 1) & ~(mesh_file_header::alignment - 1);
+		}
+	} // end namespace detail
+
+	// Writes to a temporary file next to path and renames it into place, so
+	// a mapping of the old file is never overwritten under a running render
+	// and a failed write leaves no partial mesh behind.
+	inline void write(const std::string& path, const vec3* vertices, const std::size_t vertex_count,
+		const std::uint32_t* indices, const std::size_t index_count) {
+
+		mesh_file_header header{};
+		std::memcpy(header.magic, mesh_file_header::expected_magic, sizeof(header.magic));
+		header.version = mesh_file_header::current_version;
+		header.endian_tag = mesh_file_header::expected_endian_tag;
+		header.vertex_count = vertex_count;
+		header.index_count = index_count;
+		header.vertex_offset = detail::align(sizeof(header));
+		header.index_offset = detail::align(header.vertex_offset + vertex_count * sizeof(vec3));
+
+		const auto temp = path + "." + std::to_string(std::random_device{}()) + ".tmp";
+		{
+			std::ofstream out{ temp, std::ios::binary | std::ios::trunc };
+			const char padding[mesh_file_header::alignment]{};
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(padding, header.vertex_offset - sizeof(header));
+			out.write(reinterpret_cast<const char*>(vertices), vertex_count * sizeof(vec3));
+			out.write(padding, header.index_offset - (header.vertex_offset + vertex_count * sizeof(vec3)));
+			out.write(reinterpret_cast<const char*>(indices), index_count * sizeof(std::uint32_t));
+			if (!out.flush()) {
+				out.close();
+				std::remove(temp.c_str());
+				throw std::runtime_error{ "cannot write " + temp };
+			}
+		}
+		if (std::rename(temp.c_str(), path.c_str()) != 0) {
+			// rename() does not replace an existing file on every platform.
+			std::remove(path.c_str());
+			if (std::rename(temp.c_str(), path.c_str()) != 0) {
+				std::remove(temp.c_str());
+				throw std::runtime_error{ "cannot replace " + path };
+			}
+		}
+	}
+
+	inline void write(const std::string& path, const mesh_arrays& mesh) {
+		write(path, mesh.vertices.data(), mesh.vertices.size(), mesh.indices.data(), mesh.indices.size());
+	}
+
+	// Maps a mesh file and returns buffers that point into the mapping, which
+	// stays alive as long as the buffers do. The header and array bounds are
+	// always checked; check_indices additionally scans every index against
+	// the vertex count, which touches the whole index array once.
+	inline mesh_buffers map(const std::string& path, const bool check_indices = true) {
+		auto file = std::make_shared<const mapped_file>(path);
+		const auto fail = [&path](const char* why) {
+			return std::runtime_error{ path + ": " + why };
+		};
+
+		if (file->size() < sizeof(mesh_file_header)) {
+			throw fail("too small to be a mesh file");
+		}
+		mesh_file_header header{};
+		std::memcpy(&header, file->data(), sizeof(header));
+		if (std::memcmp(header.magic, mesh_file_header::expected_magic, sizeof(header.magic)) != 0) {
+			throw fail("not a mesh file");
+		}
+		if (header.version != mesh_file_header::current_version) {
+			throw fail("unsupported mesh file version");
+		}
+		if (header.endian_tag != mesh_file_header::expected_endian_tag) {
+			throw fail("mesh file was written with a different byte order");
+		}
+		if (header.index_count % 3 != 0) {
+			throw fail("index count is not a multiple of three");
+		}
+		if (header.vertex_count > std::uint64_t{ 1 } << 32 || header.index_count / 3 >= std::uint64_t{ 1 } << 32) {
+			throw fail("mesh is too large for 32-bit indices");
+		}
+		if (header.vertex_offset % mesh_file_header::alignment != 0 || header.index_offset % mesh_file_header::alignment != 0) {
+			throw fail("misaligned mesh arrays");
+		}
+		if (header.vertex_offset < sizeof(header) || !array_fits(header.vertex_offset, header.vertex_count, sizeof(vec3), file->size()) ||
+			!array_fits(header.index_offset, header.index_count, sizeof(std::uint32_t), file->size()) ||
+			header.index_offset < header.vertex_offset || header.index_offset - header.vertex_offset < header.vertex_count * sizeof(vec3)) {
+			throw fail("mesh arrays overrun the file");
+		}
+
+		const auto* vertices = reinterpret_cast<const vec3*>(file->data() + header.vertex_offset);
+		const auto* indices = reinterpret_cast<const std::uint32_t*>(file->data() + header.index_offset);
+		if (check_indices) {
+			for (std::uint64_t i = 0; i < header.index_count; i++) {
+				if (indices[i] >= header.vertex_count) {
+					throw fail("index out of range");
+				}
+			}
+		}
+		return { vertices, static_cast<std::size_t>(header.vertex_count),
+				 indices, static_cast<std::size_t>(header.index_count), std::move(file) };
+	}
+
+	// Maps the mesh and loads its bvh from a cache file named path + ".bvh",
+	// building and storing it there the first time or after the mesh
+	// changes, so a mesh is parsed and built at most once.
+	inline triangle_mesh load(const std::string& path, const surface& surface_) {
+		return triangle_mesh{ map(path), surface_, path + ".bvh" };
+	}
+
+	// Converts an .obj or binary .ply file to the mesh file format.
+	inline void convert(const std::string& source, const std::string& dest) {
+		const auto ext = source.substr(source.find_last_of('.') + 1);
+		if (ext == "obj" || ext == "OBJ") {
+			write(dest, mesh_import::load_obj(source));
+		}
+		else if (ext == "ply" || ext == "PLY") {
+			write(dest, mesh_import::load_ply(source));
+		}
+		else {
+			throw std::runtime_error{ source + ": unknown mesh format" };
+		}
+	}
+} // end namespace mesh_file
@@ -0,0 +1,453 @@
+#pragma once
+
+#include "MappedFile.h"
+#include "vec3.h"
+#include "Workers.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Flat triangle arrays produced by the importers.
+struct mesh_arrays {
+	std::vector<vec3> vertices;
+	std::vector<std::uint32_t> indices;	// three per triangle
+};
+
+struct import_stats {
+	std::size_t bytes{ 0 };
+	double seconds{ 0.0 };
+
+	double megabytes_per_second() const noexcept {
+		return seconds > 0.0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0;
+	}
+};
+
+namespace mesh_import {
+	namespace detail {
+		inline bool is_space(const char c) noexcept {
+			return c == ' ' || c == '\t' || c == '\r';
+		}
+
+		inline const char* skip_space(const char* p, const char* end) noexcept {
+			while (p < end && is_space(*p)) {
+				p++;
+			}
+			return p;
+		}
+
+		inline const char* skip_token(const char* p, const char* end) noexcept {
+			while (p < end && !is_space(*p) && *p != '\n') {
+				p++;
+			}
+			return p;
+		}
+
+		inline const char* next_line(const char* p, const char* end) noexcept {
+			const auto* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+			return nl ? nl + 1 : end;
+		}
+
+		template <typename T>
+		const char* parse(const char* p, const char* end, T& out) {
+			p = skip_space(p, end);
+			if (p < end && *p == '+') {
+				p++;
+			}
+			const auto [ptr, ec] = std::from_chars(p, end, out);
+			if (ec != std::errc{}) {
+				throw std::runtime_error{ "malformed number in mesh file" };
+			}
+			return ptr;
+		}
+
+		// Resolves a 1-based (or negative, relative to the vertices defined so
+		// far) OBJ index.
+		inline std::uint32_t obj_index(const long long index, const std::size_t defined, const std::size_t total) {
+			const auto resolved = index < 0 ? static_cast<long long>(defined) + index : index - 1;
+			if (resolved < 0 || resolved >= static_cast<long long>(total)) {
+				throw std::runtime_error{ "OBJ face references a missing vertex" };
+			}
+			return static_cast<std::uint32_t>(resolved);
+		}
+
+		inline bool is_record(const char* p, const char* end, const char type) noexcept {
+			return end - p > 1 && p[0] == type && is_space(p[1]);
+		}
+
+		// Splits [begin, end) into about `count` pieces that each end on a
+		// line boundary.
+		inline std::vector<const char*> split_lines(const char* begin, const char* end, const std::size_t count) {
+			std::vector<const char*> bounds{ begin };
+			const auto step = static_cast<std::size_t>(end - begin) / count + 1;
+			for (auto p = begin; p < end;) {
+				p = next_line(std::min(p + step, end), end);
+				bounds.push_back(p);
+			}
+			if (bounds.size() == 1) {
+				bounds.push_back(end);
+			}
+			return bounds;
+		}
+
+		struct obj_counts {
+			std::size_t vertices{ 0 };
+			std::size_t triangles{ 0 };
+		};
+
+		// First pass over a chunk: sizes only, so that every chunk knows where
+		// its output starts before anything is parsed.
+		inline obj_counts count_obj(const char* p, const char* end) noexcept {
+			obj_counts counts{};
+			while (p < end) {
+				p = skip_space(p, end);
+				if (is_record(p, end, 'v')) {
+					counts.vertices++;
+				}
+				else if (is_record(p, end, 'f')) {
+					std::size_t corners{ 0 };
+					for (p = skip_space(p + 1, end); p < end && *p != '\n'; p = skip_space(p, end)) {
+						p = skip_token(p, end);
+						corners++;
+					}
+					counts.triangles += corners > 2 ? corners - 2 : 0;
+				}
+				p = next_line(p, end);
+			}
+			return counts;
+		}
+
+		// Second pass: parses the "v" and "f" records of a chunk straight into
+		// its slice of the output. Everything else (normals, texture
+		// coordinates, groups, materials) is ignored, and faces with more than
+		// three corners are fan-triangulated. vertex_base is the number of
+		// vertices defined by earlier chunks.
+		inline void parse_obj(const char* p, const char* end, const std::size_t vertex_base, const std::size_t vertex_total,
+			vec3* vertices, std::uint32_t* indices) {
+			auto defined = vertex_base;
+			while (p < end) {
+				p = skip_space(p, end);
+				if (is_record(p, end, 'v')) {
+					vec3 v{};
+					p = parse(p + 1, end, v.x);
+					p = parse(p, end, v.y);
+					p = parse(p, end, v.z);
+					*vertices++ = v;
+					defined++;
+				}
+				else if (is_record(p, end, 'f')) {
+					std::uint32_t first{ 0 }, prev{ 0 };
+					auto corner{ 0 };
+					for (p = skip_space(p + 1, end); p < end && *p != '\n'; p = skip_space(p, end)) {
+						long long index{ 0 };
+						p = skip_token(parse(p, end, index), end);	// drop "/vt/vn"
+						const auto v = obj_index(index, defined, vertex_total);
+						if (corner == 0) {
+							first = v;
+						}
+						else if (corner >= 2) {
+							*indices++ = first;
+							*indices++ = prev;
+							*indices++ = v;
+						}
+						prev = v;
+						corner++;
+					}
+				}
+				p = next_line(p, end);
+			}
+		}
+
+		// Runs body(i) for i in [0, count) on the worker threads and rethrows
+		// the first failure once they have all finished.
+		template <typename Body>
+		void parallel_chunks(const int count, Body&& body) {
+			std::vector<std::string> errors(count);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+			for (auto i = 0; i < count; i++) {
+				try {
+					body(i);
+				}
+				catch (const std::exception& e) {
+					errors[i] = e.what();
+				}
+			}
+			for (const auto& e : errors) {
+				if (!e.empty()) {
+					throw std::runtime_error{ e };
+				}
+			}
+		}
+
+		enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64 };
+
+		inline ply_type parse_ply_type(const std::string_view name) {
+			if (name == "char" || name == "int8") return ply_type::int8;
+			if (name == "uchar" || name == "uint8") return ply_type::uint8;
+			if (name == "short" || name == "int16") return ply_type::int16;
+			if (name == "ushort" || name == "uint16") return ply_type::uint16;
+			if (name == "int" || name == "int32") return ply_type::int32;
+			if (name == "uint" || name == "uint32") return ply_type::uint32;
+			if (name == "float" || name == "float32") return ply_type::float32;
+			if (name == "double" || name == "float64") return ply_type::float64;
+			throw std::runtime_error{ "unknown PLY property type" };
+		}
+
+		constexpr std::size_t ply_size(const ply_type t) noexcept {
+			switch (t) {
+			case ply_type::int8: case ply_type::uint8: return 1;
+			case ply_type::int16: case ply_type::uint16: return 2;
+			case ply_type::int32: case ply_type::uint32: case ply_type::float32: return 4;
+			default: return 8;
+			}
+		}
+
+		// Reads one little-endian PLY scalar as T.
+		template <typename T>
+		T read_ply(const std::byte* p, const ply_type t) noexcept {
+			const auto load = [p](auto v) { std::memcpy(&v, p, sizeof(v)); return static_cast<T>(v); };
+			switch (t) {
+			case ply_type::int8: return load(std::int8_t{});
+			case ply_type::uint8: return load(std::uint8_t{});
+			case ply_type::int16: return load(std::int16_t{});
+			case ply_type::uint16: return load(std::uint16_t{});
+			case ply_type::int32: return load(std::int32_t{});
+			case ply_type::uint32: return load(std::uint32_t{});
+			case ply_type::float32: return load(float{});
+			default: return load(double{});
+			}
+		}
+
+		struct ply_layout {
+			std::size_t vertex_count{ 0 };
+			std::size_t face_count{ 0 };
+			std::size_t vertex_stride{ 0 };
+			std::size_t position_offset[3]{};
+			ply_type position_type[3]{ ply_type::float32, ply_type::float32, ply_type::float32 };
+			ply_type face_count_type{ ply_type::uint8 };
+			ply_type face_index_type{ ply_type::int32 };
+			std::size_t body{ 0 };	// byte offset of the first vertex
+		};
+
+		// Parses the header of a binary little-endian PLY file with a
+		// "vertex" element (x, y, z and any other fixed-size properties)
+		// followed by a "face" element whose only property is its index list.
+		inline ply_layout parse_ply_header(const mapped_file& file) {
+			const auto* begin = reinterpret_cast<const char*>(file.data());
+			const auto* end = begin + file.size();
+			if (file.size() < 4 || std::string_view{ begin, 3 } != "ply") {
+				throw std::runtime_error{ "not a PLY file" };
+			}
+
+			ply_layout layout{};
+			std::string_view element{};
+			auto found_xyz{ 0 };
+			auto face_lists{ 0 };
+			for (const char* p = next_line(begin, end); p < end;) {
+				const auto* eol = next_line(p, end);
+				auto line = std::string_view{ p, static_cast<std::size_t>(eol - p) };
+				while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+					line.remove_suffix(1);
+				}
+				p = eol;
+
+				std::string_view words[4]{};
+				for (std::size_t n = 0, pos = 0; n < 4; n++) {
+					const auto start = line.find_first_not_of(' ', pos);
+					if (start == std::string_view::npos) {
+						break;
+					}
+					pos = std::min(line.find(' ', start), line.size());
+					words[n] = line.substr(start, pos - start);
+				}
+
+				const auto keyword = words[0];
+				if (keyword == "format") {
+					if (words[1] != "binary_little_endian") {
+						throw std::runtime_error{ "only binary little-endian PLY files are supported" };
+					}
+				}
+				else if (keyword == "element") {
+					element = words[1];
+					std::size_t count{ 0 };
+					const auto c = words[2];
+					if (const auto [ptr, ec] = std::from_chars(c.data(), c.data() + c.size(), count);
+						c.empty() || ec != std::errc{} || ptr != c.data() + c.size()) {
+						throw std::runtime_error{ "malformed PLY element count" };
+					}
+					if (element == "vertex") {
+						if (layout.face_count > 0) {
+							throw std::runtime_error{ "PLY faces must follow the vertices" };
+						}
+						layout.vertex_count = count;
+					}
+					else if (element == "face") {
+						layout.face_count = count;
+					}
+					else if (count > 0) {
+						throw std::runtime_error{ "unsupported PLY element" };
+					}
+				}
+				else if (keyword == "property" && element == "vertex") {
+					if (words[1] == "list") {
+						throw std::runtime_error{ "list properties on PLY vertices are not supported" };
+					}
+					const auto type = parse_ply_type(words[1]);
+					const auto name = words[2];
+					const auto axis = name == "x" ? 0 : name == "y" ? 1 : name == "z" ? 2 : -1;
+					if (axis >= 0) {
+						layout.position_offset[axis] = layout.vertex_stride;
+						layout.position_type[axis] = type;
+						found_xyz |= 1 << axis;
+					}
+					layout.vertex_stride += ply_size(type);
+				}
+				else if (keyword == "property" && element == "face") {
+					if (words[1] != "list" || ++face_lists > 1) {
+						throw std::runtime_error{ "PLY faces must only have an index list" };
+					}
+					layout.face_count_type = parse_ply_type(words[2]);
+					layout.face_index_type = parse_ply_type(words[3]);
+				}
+				else if (keyword == "end_header") {
+					layout.body = static_cast<std::size_t>(p - begin);
+					if (found_xyz != 7) {
+						throw std::runtime_error{ "PLY vertices have no position" };
+					}
+					if (layout.face_count > 0 && face_lists == 0) {
+						throw std::runtime_error{ "PLY faces have no index list" };
+					}
+					return layout;
+				}
+			}
+			throw std::runtime_error{ "truncated PLY header" };
+		}
+	} // end namespace detail
+
+	// Splits the file into line-aligned chunks, sizes every chunk in
+	// parallel, then parses each chunk straight into its place in the output.
+	// Output arrays are allocated once; no token is copied out of the mapping.
+	inline mesh_arrays load_obj(const std::string& path, import_stats* stats = nullptr) {
+		const auto start = std::chrono::steady_clock::now();
+		const mapped_file file{ path };
+		const auto* begin = reinterpret_cast<const char*>(file.data());
+		const auto bounds = detail::split_lines(begin, begin + file.size(), 8 * workers::count());
+		const auto chunks = static_cast<int>(bounds.size() - 1);
+
+		std::vector<detail::obj_counts> offsets(chunks + 1);
+		detail::parallel_chunks(chunks, [&](const int i) {
+			offsets[i + 1] = detail::count_obj(bounds[i], bounds[i + 1]);
+		});
+		for (auto i = 0; i < chunks; i++) {
+			offsets[i + 1].vertices += offsets[i].vertices;
+			offsets[i + 1].triangles += offsets[i].triangles;
+		}
+
+		mesh_arrays out{};
+		out.vertices.resize(offsets[chunks].vertices);
+		out.indices.resize(3 * offsets[chunks].triangles);
+		detail::parallel_chunks(chunks, [&](const int i) {
+			detail::parse_obj(bounds[i], bounds[i + 1], offsets[i].vertices, out.vertices.size(),
+				out.vertices.data() + offsets[i].vertices, out.indices.data() + 3 * offsets[i].triangles);
+		});
+
+		if (stats) {
+			*stats = { file.size(), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() };
+		}
+		return out;
+	}
+
+	// Vertices have a fixed stride and are decoded in parallel directly.
+	// Faces are variable length, so one cheap sequential pass over the face
+	// sizes finds where each chunk of faces starts before they are decoded in
+	// parallel.
+	inline mesh_arrays load_ply(const std::string& path, import_stats* stats = nullptr) {
+		const auto start = std::chrono::steady_clock::now();
+		const mapped_file file{ path };
+		const auto layout = detail::parse_ply_header(file);
+		const auto* vertex_data = file.data() + layout.body;
+		const auto* end = file.data() + file.size();
+		// Divided rather than multiplied, as a corrupt count could wrap.
+		if (layout.vertex_stride == 0 || layout.vertex_count > static_cast<std::size_t>(end - vertex_data) / layout.vertex_stride) {
+			throw std::runtime_error{ "truncated PLY vertex data" };
+		}
+
+		mesh_arrays out{};
+		out.vertices.resize(layout.vertex_count);
+		const auto vertex_count = static_cast<std::int64_t>(layout.vertex_count);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+		for (std::int64_t i = 0; i < vertex_count; i++) {
+			const auto* v = vertex_data + i * layout.vertex_stride;
+			out.vertices[i] = {
+				detail::read_ply<float>(v + layout.position_offset[0], layout.position_type[0]),
+				detail::read_ply<float>(v + layout.position_offset[1], layout.position_type[1]),
+				detail::read_ply<float>(v + layout.position_offset[2], layout.position_type[2]) };
+		}
+
+		struct face_chunk {
+			const std::byte* data;
+			std::size_t faces;
+			std::size_t first_triangle;
+		};
+		const auto count_size = detail::ply_size(layout.face_count_type);
+		const auto index_size = detail::ply_size(layout.face_index_type);
+		const auto faces_per_chunk = layout.face_count / (8 * workers::count()) + 1;
+		std::vector<face_chunk> chunks{};
+		std::size_t triangles{ 0 };
+		auto* p = vertex_data + layout.vertex_count * layout.vertex_stride;
+		for (std::size_t f = 0; f < layout.face_count; f++) {
+			if (f % faces_per_chunk == 0) {
+				chunks.push_back({ p, 0, triangles });
+			}
+			if (static_cast<std::size_t>(end - p) < count_size) {
+				throw std::runtime_error{ "truncated PLY face data" };
+			}
+			// A negative count reads as a huge one; checked before p moves.
+			const auto corners = detail::read_ply<std::size_t>(p, layout.face_count_type);
+			if (corners > (static_cast<std::size_t>(end - p) - count_size) / index_size) {
+				throw std::runtime_error{ "truncated PLY face data" };
+			}
+			p += count_size + corners * index_size;
+			triangles += corners > 2 ? corners - 2 : 0;
+			chunks.back().faces++;
+		}
+
+		out.indices.resize(3 * triangles);
+		detail::parallel_chunks(static_cast<int>(chunks.size()), [&](const int c) {
+			const auto index = [&](const std::byte* at) {
+				const auto i = detail::read_ply<std::uint32_t>(at, layout.face_index_type);
+				if (i >= layout.vertex_count) {
+					throw std::runtime_error{ "PLY face references a missing vertex" };
+				}
+				return i;
+			};
+			const auto* q = chunks[c].data;
+			auto* dst = out.indices.data() + 3 * chunks[c].first_triangle;
+			for (std::size_t f = 0; f < chunks[c].faces; f++) {
+				const auto corners = detail::read_ply<std::size_t>(q, layout.face_count_type);
+				q += count_size;
+				for (std::size_t k = 2; k < corners; k++) {
+					*dst++ = index(q);
+					*dst++ = index(q + (k - 1) * index_size);
+					*dst++ = index(q + k * index_size);
+				}
+				q += corners * index_size;
+			}
+		});
+
+		if (stats) {
+			*stats = { file.size(), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() };
+		}
+		return out;
+	}
+} // end namespace mesh_import
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+class any_thing;
+
+// The thing that last blocked a shadow ray towards each light, kept per
+// worker thread. Neighbouring points in a light's shadow are mostly shadowed
+// by the same thing, so testing it first settles many shadow rays without a
+// traversal. Only ever confirms a shadow: a miss falls back to the full
+// query, so results do not depend on what is cached.
+class occluder_cache {
+public:
+	static constexpr std::uint32_t slots{ 64 };	// lights past the 64th share slots
+
+	const any_thing*& last(const std::uint32_t light) noexcept {
+		return m_last[light % slots];
+	}
+
+	// Drops every cached occluder, keeping the counts, once the things may
+	// no longer exist.
+	void forget() noexcept {
+		for (auto& thing : m_last) {
+			thing = nullptr;
+		}
+	}
+
+	std::uint64_t lookups{ 0 };	// shadow rays that tried a cached occluder
+	std::uint64_t hits{ 0 };	// of which the occluder still blocked the ray
+
+private:
+	const any_thing* m_last[slots]{};
+};
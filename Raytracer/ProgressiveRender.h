@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Raytracer.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+struct progressive_pass {
+	int index;	// 0 for the coarsest pass
+	int stride;	// one traced pixel per stride x stride block
+	bool final;
+};
+
+namespace progressive {
+	// 1/16, 1/4 and finally all of the pixels.
+	inline constexpr std::array<int, 3> strides{ 4, 2, 1 };
+
+	// Tiles must be aligned to the coarsest stride so every tile agrees on
+	// which pixels belong to which pass.
+	inline constexpr int tile_size{ 4 * strides[0] };
+
+	// Traces the pixels new to pass `pass` and fills each one's stride x stride
+	// block on the canvas. Tiles for which skip_tile() returns true when they
+	// are reached are left as the previous pass drew them. Returns whether
+	// every tile was traced.
+	template <typename Scene, typename Canvas, typename Skip>
+	bool render_pass(const ray_tracer& tracer, const Scene& scene, Canvas& canvas, const int width, const int height,
+		render_context& ctx, const int pass, Skip&& skip_tile) {
+
+		const auto stride = strides[pass];
+		const auto coarser = pass > 0 ? strides[pass - 1] : 0;
+		std::atomic<int> skipped{ 0 };
+
+		ctx.for_each_tile(width, height, tile_size, [&](const tile& t, arena&, render_stats& stats) {
+			if (skip_tile()) {
+				skipped++;
+				return;
+			}
+			auto& occluders = ctx.get_occluders(workers::index());
+			for (auto y = t.y0; y < t.y0 + t.height; y += stride) {
+				for (auto x = t.x0; x < t.x0 + t.width; x += stride) {
+					if (coarser && x % coarser == 0 && y % coarser == 0) {
+						continue;
+					}
+					const auto col = tracer.sample_pixel(scene, width, height, x, y, &occluders).col;
+					for (auto by = y; by < std::min(y + stride, height); by++) {
+						for (auto bx = x; bx < std::min(x + stride, width); bx++) {
+							canvas.set_pixel(bx, by, col);
+						}
+					}
+					stats.primary_rays++;
+				}
+			}
+		});
+		return skipped == 0;
+	}
+
+	// Renders successively finer passes, calling on_pass(progressive_pass)
+	// after each one has been written to the canvas. A coarse sample fills its
+	// whole stride x stride block, and later passes only trace the pixels that
+	// no earlier pass has, so the final image costs the same number of primary
+	// rays as a plain render.
+	template <typename Scene, typename Canvas, typename Callback>
+	void render(const ray_tracer& tracer, const Scene& scene, Canvas& canvas, const int width, const int height,
+		render_context& ctx, Callback&& on_pass) {
+
+		ctx.begin_frame();
+		for (auto pass = 0; pass < static_cast<int>(strides.size()); pass++) {
+			render_pass(tracer, scene, canvas, width, height, ctx, pass, [] { return false; });
+			on_pass(progressive_pass{ pass, strides[pass], strides[pass] == 1 });
+		}
+	}
+} // end namespace progressive
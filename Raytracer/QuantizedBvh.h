@@ -0,0 +1,233 @@
+#pragma once
+
+#include "Bvh.h"
+#include "WideBvh.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// 4-wide BVH node with child bounds quantized to 8 bits per plane. Each
+// node stores the origin of its box and a power-of-two step per axis; a
+// child plane q decodes to origin + q * step. Planes are rounded outward,
+// so decoded boxes always contain the exact ones. One node fills one cache
+// line, against 144 bytes for a float wide_bvh_node<4>.
+struct alignas(64) quantized_bvh_node {
+	float origin[3];
+	std::int8_t exponent[3];	// step = 2^exponent
+	std::uint8_t valid;	// bit i set when child i exists
+	std::uint8_t lo_x[4], lo_y[4], lo_z[4];
+	std::uint8_t hi_x[4], hi_y[4], hi_z[4];
+	std::uint32_t first[4];	// child node, or first primitive slot for leaf children
+	std::uint16_t count[4];	// primitives for leaf children, 0 for interior children
+};
+static_assert(sizeof(quantized_bvh_node) == 64, "quantized_bvh_node should fill one cache line");
+
+// Bytes held by the trees a quantized_bvh is built through, for comparing
+// the formats on the same scene. Each includes the primitive index array.
+struct bvh_memory_report {
+	std::size_t binary_bytes{ 0 };
+	std::size_t wide_bytes{ 0 };
+	std::size_t quantized_bytes{ 0 };
+};
+
+namespace quantized_bvh_detail {
+	// 2^e for e in [-126, 127], built directly from the exponent bits.
+	inline float step(const int e) noexcept {
+		const auto bits = static_cast<std::uint32_t>(e + 127) << 23;
+		float f;
+		std::memcpy(&f, &bits, sizeof(f));
+		return f;
+	}
+
+	inline float decode(const float origin, const std::uint8_t q, const int e) noexcept {
+		return origin + static_cast<float>(q) * step(e);
+	}
+
+	inline unsigned slab_test(const quantized_bvh_node& n, const bvh_ray& r, const float t_max, float* t_near) noexcept {
+		unsigned mask{ 0 };
+		for (auto i = 0; i < 4; i++) {
+			const aabb b{ { decode(n.origin[0], n.lo_x[i], n.exponent[0]), decode(n.origin[1], n.lo_y[i], n.exponent[1]), decode(n.origin[2], n.lo_z[i], n.exponent[2]) },
+						  { decode(n.origin[0], n.hi_x[i], n.exponent[0]), decode(n.origin[1], n.hi_y[i], n.exponent[1]), decode(n.origin[2], n.hi_z[i], n.exponent[2]) } };
+			t_near[i] = r.enter(b, t_max);
+			mask |= (t_near[i] <= t_max ? 1u : 0u) << i;
+		}
+		return mask & n.valid;
+	}
+
+#ifdef HAVE_SSE2_INTRINSICS
+	// Widens four packed bytes to floats and decodes them, with the same
+	// multiply and add as decode() so the results match it exactly.
+	inline __m128 decode4(const std::uint8_t* q, const float origin, const int e) noexcept {
+		std::int32_t packed;
+		std::memcpy(&packed, q, sizeof(packed));
+		const auto zero = _mm_setzero_si128();
+		const auto wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+		return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(step(e))));
+	}
+
+	inline unsigned slab_test_sse(const quantized_bvh_node& n, const bvh_ray& r, const float t_max, float* t_near) noexcept {
+		const auto ix = _mm_set1_ps(r.inv_dir.x);
+		const auto iy = _mm_set1_ps(r.inv_dir.y);
+		const auto iz = _mm_set1_ps(r.inv_dir.z);
+		const auto ox = _mm_set1_ps(r.start.x);
+		const auto oy = _mm_set1_ps(r.start.y);
+		const auto oz = _mm_set1_ps(r.start.z);
+		const auto tx0 = _mm_mul_ps(_mm_sub_ps(decode4(n.lo_x, n.origin[0], n.exponent[0]), ox), ix);
+		const auto tx1 = _mm_mul_ps(_mm_sub_ps(decode4(n.hi_x, n.origin[0], n.exponent[0]), ox), ix);
+		const auto ty0 = _mm_mul_ps(_mm_sub_ps(decode4(n.lo_y, n.origin[1], n.exponent[1]), oy), iy);
+		const auto ty1 = _mm_mul_ps(_mm_sub_ps(decode4(n.hi_y, n.origin[1], n.exponent[1]), oy), iy);
+		const auto tz0 = _mm_mul_ps(_mm_sub_ps(decode4(n.lo_z, n.origin[2], n.exponent[2]), oz), iz);
+		const auto tz1 = _mm_mul_ps(_mm_sub_ps(decode4(n.hi_z, n.origin[2], n.exponent[2]), oz), iz);
+		const auto enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+			_mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+		const auto exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+			_mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+		_mm_storeu_ps(t_near, enter);
+		return static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(enter, exit))) & n.valid;
+	}
+#endif
+
+	struct child_test {
+		unsigned operator()(const quantized_bvh_node& n, const bvh_ray& r, const float t_max, float* t_near) const noexcept {
+#ifdef HAVE_SSE2_INTRINSICS
+			return slab_test_sse(n, r, t_max, t_near);
+#else
+			return slab_test(n, r, t_max, t_near);
+#endif
+		}
+	};
+
+	// Smallest step exponent whose 255 steps from lo reach hi.
+	inline int step_exponent(const float lo, const float hi) noexcept {
+		const auto extent = hi - lo;
+		auto e = extent > 0.0f ? static_cast<int>(std::ceil(std::log2(extent / 255.0f))) : -126;
+		e = std::max(e, -126);
+		while (e < 127 && decode(lo, 255, e) < hi) {
+			e++;
+		}
+		return e;
+	}
+
+	// Largest q decoding at or below v, and smallest decoding at or above it.
+	inline std::uint8_t quantize_down(const float v, const float origin, const int e) noexcept {
+		auto q = static_cast<int>(std::floor((v - origin) / step(e)));
+		q = std::min(std::max(q, 0), 255);
+		while (q > 0 && decode(origin, static_cast<std::uint8_t>(q), e) > v) {
+			q--;
+		}
+		return static_cast<std::uint8_t>(q);
+	}
+
+	inline std::uint8_t quantize_up(const float v, const float origin, const int e) noexcept {
+		auto q = static_cast<int>(std::ceil((v - origin) / step(e)));
+		q = std::min(std::max(q, 0), 255);
+		while (q < 255 && decode(origin, static_cast<std::uint8_t>(q), e) < v) {
+			q++;
+		}
+		return static_cast<std::uint8_t>(q);
+	}
+} // end namespace quantized_bvh_detail
+
+// 4-wide BVH with quantized nodes, for scenes large enough that node memory
+// and bandwidth dominate. Built by quantizing a bvh4; looser child boxes
+// cost some extra box hits but no missed primitives. Same interface as bvh.
+class quantized_bvh {
+public:
+	// Leaves hold at most 65535 primitives; larger ones throw length_error.
+	template <typename BoundsOf>
+	void build(const std::uint32_t prim_count, BoundsOf&& bounds_of, bvh_build_stats* stats = nullptr) {
+		const auto start = std::chrono::steady_clock::now();
+		bvh binary;
+		binary.build(prim_count, bounds_of, stats);
+		bvh4 wide;
+		wide.collapse(binary);
+		compress(wide);
+		m_report = { binary.memory_bytes(), wide.memory_bytes(), memory_bytes() };
+		if (stats) {
+			stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+
+	void compress(const bvh4& wide) {
+		m_prims = wide.prim_indices();
+		m_bounds = wide.bounds();
+		m_nodes.assign(wide.nodes().size(), {});
+		for (std::size_t i = 0; i < m_nodes.size(); i++) {
+			compress_node(wide.nodes()[i], m_nodes[i]);
+		}
+	}
+
+	template <typename Intersect>
+	bool closest_hit(const ray& r, float& t_max, Intersect&& intersect) const {
+		return wide_bvh_detail::closest_hit<4>(m_nodes, r, t_max, quantized_bvh_detail::child_test{}, intersect);
+	}
+
+	template <typename Occludes>
+	bool any_hit(const ray& r, const float t_max, Occludes&& occludes) const {
+		return wide_bvh_detail::any_hit<4>(m_nodes, r, t_max, quantized_bvh_detail::child_test{}, occludes);
+	}
+
+	aabb bounds() const noexcept {
+		return m_bounds;
+	}
+
+	const std::vector<quantized_bvh_node>& nodes() const noexcept {
+		return m_nodes;
+	}
+
+	const std::vector<std::uint32_t>& prim_indices() const noexcept {
+		return m_prims;
+	}
+
+	std::size_t memory_bytes() const noexcept {
+		return m_nodes.size() * sizeof(quantized_bvh_node) + m_prims.size() * sizeof(std::uint32_t);
+	}
+
+	// Sizes of this tree and of the float trees it was built from.
+	const bvh_memory_report& memory_report() const noexcept {
+		return m_report;
+	}
+
+private:
+	static void compress_node(const wide_bvh_node<4>& src, quantized_bvh_node& dst) {
+		using namespace quantized_bvh_detail;
+		aabb box{};
+		for (auto i = 0; i < 4; i++) {
+			if (src.valid & (1u << i)) {
+				box.grow(aabb{ { src.lo_x[i], src.lo_y[i], src.lo_z[i] }, { src.hi_x[i], src.hi_y[i], src.hi_z[i] } });
+			}
+		}
+		const float* lo[3]{ src.lo_x, src.lo_y, src.lo_z };
+		const float* hi[3]{ src.hi_x, src.hi_y, src.hi_z };
+		std::uint8_t* qlo[3]{ dst.lo_x, dst.lo_y, dst.lo_z };
+		std::uint8_t* qhi[3]{ dst.hi_x, dst.hi_y, dst.hi_z };
+		for (auto a = 0; a < 3; a++) {
+			dst.origin[a] = component(box.lo, a);
+			dst.exponent[a] = static_cast<std::int8_t>(step_exponent(component(box.lo, a), component(box.hi, a)));
+			for (auto i = 0; i < 4; i++) {
+				if (src.valid & (1u << i)) {
+					qlo[a][i] = quantize_down(lo[a][i], dst.origin[a], dst.exponent[a]);
+					qhi[a][i] = quantize_up(hi[a][i], dst.origin[a], dst.exponent[a]);
+				}
+			}
+		}
+		dst.valid = static_cast<std::uint8_t>(src.valid);
+		for (auto i = 0; i < 4; i++) {
+			if (src.count[i] > std::numeric_limits<std::uint16_t>::max()) {
+				throw std::length_error{ "quantized_bvh leaf holds too many primitives" };
+			}
+			dst.first[i] = src.first[i];
+			dst.count[i] = static_cast<std::uint16_t>(src.count[i]);
+		}
+	}
+
+	std::vector<quantized_bvh_node> m_nodes;
+	std::vector<std::uint32_t> m_prims;
+	aabb m_bounds{};
+	bvh_memory_report m_report{};
+};
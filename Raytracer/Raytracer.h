@@ -3,55 +3,83 @@
 #include "Surface.h"
 #include "Camera.h"
 #include "Geometry.h"
+#include "Instancing.h"
+#include "Light.h"
+#include "LightTree.h"
+#include "OccluderCache.h"
+#include "ShadowPacket.h"
+#include "Thing.h"
+#include "RenderContext.h"
 
-#include <variant>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <utility>
 
-struct light {
-	vec3 pos;
-	color col;
-};
+// Scenes may provide their own acceleration structure through
+//     std::optional<intersection> intersect(const ray&) const;
+// which ray_tracer then uses instead of testing every thing in get_things().
+template <typename Scene, typename = void>
+struct has_scene_intersect : std::false_type {};
 
-class any_thing {
-	// Workaround for no capturing constexpr lambdas in Clang 4.0
-	struct intersect_visitor {
-		const any_thing* pself;
-		const ray& ray_;
+template <typename Scene>
+struct has_scene_intersect<Scene, std::void_t<decltype(std::declval<const Scene&>().intersect(std::declval<const ray&>()))>>
+	: std::true_type {};
 
-		template <typename Thing>
-		constexpr decltype(auto) operator()(const Thing& thing) const {
-			return thing.intersect(pself, ray_);
-		}
-	};
+// Likewise, an any-hit query for shadow rays
+//     bool occluded(const ray&, float t_max) const;
+// lets the accelerator stop at the first occluder instead of the closest.
+template <typename Scene, typename = void>
+struct has_scene_occluded : std::false_type {};
 
-	struct normal_visitor {
-		const vec3& pos;
+template <typename Scene>
+struct has_scene_occluded<Scene, std::void_t<decltype(std::declval<const Scene&>().occluded(std::declval<const ray&>(), 0.0f))>>
+	: std::true_type {};
 
-		template <typename Thing>
-		constexpr decltype(auto) operator()(const Thing& thing) const {
-			return thing.get_normal(pos);
-		}
-	};
+// Naming the thing found blocking a shadow ray
+//     const any_thing* occluder(const ray&, float t_max) const;
+// lets ray_tracer retest it first for nearby shadow rays (see occluder_cache).
+template <typename Scene, typename = void>
+struct has_scene_occluder : std::false_type {};
 
-public:
-	template <typename T>
-	constexpr any_thing(T&& t) : m_item(std::forward<T>(t)) {}
+template <typename Scene>
+struct has_scene_occluder<Scene, std::void_t<decltype(std::declval<const Scene&>().occluder(std::declval<const ray&>(), 0.0f))>>
+	: std::true_type {};
 
-	constexpr auto intersect(const ray& ray_) const {
-		return std::visit(intersect_visitor{ this, ray_ }, m_item);
-	}
+// A packet form
+//     std::uint32_t occluded(const shadow_packet&) const;
+// returning the blocked lanes lets a shading point test its shadow rays
+// towards several lights together.
+template <typename Scene, typename = void>
+struct has_scene_occluded_packet : std::false_type {};
 
-	constexpr vec3 get_normal(const vec3& pos) const {
-		return std::visit(normal_visitor{ pos }, m_item);
-	}
+template <typename Scene>
+struct has_scene_occluded_packet<Scene, std::void_t<decltype(std::declval<const Scene&>().occluded(std::declval<const shadow_packet&>()))>>
+	: std::true_type {};
 
-	constexpr const surface& get_surface() const {
-		return std::visit([](const auto& thing_) -> decltype(auto) {
-			return thing_.get_surface();
-		}, m_item);
-	}
+// And a light hierarchy
+//     const light_tree& get_light_tree() const;
+// limits shading to the lights that can reach each point.
+template <typename Scene, typename = void>
+struct has_scene_light_tree : std::false_type {};
+
+template <typename Scene>
+struct has_scene_light_tree<Scene, std::void_t<decltype(std::declval<const Scene&>().get_light_tree())>>
+	: std::true_type {};
+
+// Lights that can reach some part of the frame, as ascending indices into
+// the scene's lights.
+struct light_list {
+	const std::uint32_t* indices;
+	std::uint32_t count;
+};
 
-private:
-	std::variant<sphere, plane> m_item;
+struct pixel_sample {
+	color col;
+	const any_thing* thing;
+	std::uint32_t shadow_mask; // bit i set when light i is occluded
 };
 
 class ray_tracer {
@@ -59,6 +87,16 @@ class ray_tracer {
 
 	template <typename Scene>
 	constexpr auto get_intersections(const ray& ray_, const Scene& scene_) const {
+		if constexpr (has_scene_intersect<Scene>::value) {
+			return scene_.intersect(ray_);
+		}
+		else {
+			return intersect_things(ray_, scene_);
+		}
+	}
+
+	template <typename Scene>
+	constexpr std::optional<intersection> intersect_things(const ray& ray_, const Scene& scene_) const {
 		auto closest{ std::numeric_limits<float>::max() };
 		// Workaround lack of constexpr copy/move assignment and operator->()
 		// in libstdc++ std::optional w/ GCC 7.1.
@@ -67,93 +105,445 @@ class ray_tracer {
 		for (const auto& t : scene_.get_things()) {
 			const auto inter{ t.intersect(ray_) };
 			
-			if constexpr (inter && (*inter).dist < closest) {
+			if (inter && (*inter).dist < closest) {
 				closest = (*inter).dist;
 				closest_inter = *inter;
 			}
 		}
 
-		if constexpr (closest == std::numeric_limits<float>::max()) {
+		if (closest == std::numeric_limits<float>::max()) {
 			return std::nullopt;
 		}
 		return closest_inter;
 	}
 
 	template <typename Scene>
-	constexpr auto test_ray(const ray& ray_, const Scene& scene_) const {
-		if constexpr (const auto& isect{ get_intersections(ray_, scene_) }; isect) {
+	constexpr std::optional<float> test_ray(const ray& ray_, const Scene& scene_) const {
+		if (const auto& isect{ get_intersections(ray_, scene_) }; isect) {
 			return isect->dist;
 		}
 		return std::nullopt;
 	}
 
 	template <typename Scene>
-	constexpr color trace_ray(const ray& ray_, const Scene& scene_, int depth) const {
-		if constexpr (const auto& isect{ get_intersections(ray_, scene_) }; isect) {
-			return shade(*isect, scene_, depth);
+	constexpr bool is_occluded(const ray& ray_, const float dist, const Scene& scene_) const {
+		if constexpr (has_scene_occluded<Scene>::value) {
+			return scene_.occluded(ray_, dist);
+		}
+		else {
+			const auto near_isect = test_ray(ray_, scene_);
+			return near_isect ? *near_isect < dist : false;
+		}
+	}
+
+	// is_occluded, first retesting the thing that last shadowed this light.
+	// Scenes that answer only occluded() cannot name occluders and skip the
+	// cache.
+	template <typename Scene>
+	bool is_occluded(const ray& ray_, const float dist, const Scene& scene_,
+		occluder_cache& occluders, const std::uint32_t light_index) const {
+		if constexpr (has_scene_occluded<Scene>::value && !has_scene_occluder<Scene>::value) {
+			return is_occluded(ray_, dist, scene_);
+		}
+		else {
+			auto& last = occluders.last(light_index);
+			if (last) {
+				occluders.lookups++;
+				// The ray must also enter the thing's bounds, as on a tree walk,
+				// or grazing hits far from the thing would disagree with it.
+				if (const auto isect = last->intersect(ray_); isect && isect->dist > 0.0f && isect->dist < dist) {
+					if (const auto bounds = last->bounds(); !bounds || bvh_ray{ ray_ }.enter(*bounds, dist) != std::numeric_limits<float>::infinity()) {
+						occluders.hits++;
+						return true;
+					}
+				}
+			}
+			// A lit point keeps the last occluder, as shadow edges alternate.
+			if constexpr (has_scene_occluder<Scene>::value) {
+				const auto* found = scene_.occluder(ray_, dist);
+				if (found) {
+					last = found;
+				}
+				return found != nullptr;
+			}
+			else {
+				const auto isect = get_intersections(ray_, scene_);
+				if (!isect || !(isect->dist < dist)) {
+					return false;
+				}
+				// Things inside an instance are hit in its object space, so only
+				// top-level things can be retested with this ray.
+				if (!isect->instance_) {
+					last = isect->thing_;
+				}
+				return true;
+			}
+		}
+	}
+
+	template <typename Scene>
+	constexpr color trace_ray(const ray& ray_, const Scene& scene_, int depth,
+		occluder_cache* occluders = nullptr) const {
+		if (const auto& isect{ get_intersections(ray_, scene_) }; isect) {
+			return shade(*isect, scene_, depth, nullptr, nullptr, occluders);
 		}
 		return color::background();
 	}
 
+	vec3 get_normal(const intersection& isect, const vec3& pos) const {
+		if (isect.instance_) {
+			const auto& inst = *isect.instance_;
+			return inst.normal_to_world(isect.thing_->get_normal(inst.point_to_object(pos), isect.prim));
+		}
+		return isect.thing_->get_normal(pos, isect.prim);
+	}
+
 	template <typename Scene>
-	constexpr color shade(const intersection& isect, const Scene& scene, int depth) const {
+	constexpr color shade(const intersection& isect, const Scene& scene, int depth,
+		std::uint32_t* shadow_mask = nullptr, const light_list* lights = nullptr, occluder_cache* occluders = nullptr) const {
 		const vec3& d = isect.ray_.dir;
 		const vec3 pos = (isect.dist * d) + isect.ray_.start;
-		const vec3 normal = isect.thing_->get_normal(pos);
+		const vec3 normal = get_normal(isect, pos);
 		const vec3 reflect_dir = d - (2 * (dot(normal, d) * normal));
-		const color natural_color = color::background() + get_natural_color(*isect.thing_, pos, normal, reflect_dir, scene);
-		const color reflected_color = depth >= m_maxDepth ? color::grey() : get_reflection_color(*isect.thing_, pos, reflect_dir, scene, depth);
+		const color natural_color = color::background() + get_natural_color(*isect.thing_, pos, normal, reflect_dir, scene, shadow_mask, lights, occluders);
+		const color reflected_color = static_cast<unsigned int>(depth) >= m_maxDepth ? color::grey() : get_reflection_color(*isect.thing_, pos, reflect_dir, scene, depth, occluders);
 		return natural_color + reflected_color;
 	}
 
 	template <typename Scene>
-	constexpr color get_reflection_color(const any_thing& thing_, const vec3& pos, const vec3& rd, const Scene& scene, int depth) const {
+	constexpr color get_reflection_color(const any_thing& thing_, const vec3& pos, const vec3& rd, const Scene& scene, int depth,
+		occluder_cache* occluders = nullptr) const {
 		
-		return scale(thing_.get_surface().reflect(pos), trace_ray({ pos, rd }, scene, depth + 1));
+		return scale(thing_.get_surface().reflect(pos), trace_ray({ pos, rd }, scene, depth + 1, occluders));
 	}
 
 	template <typename Scene>
 	constexpr color add_light(const any_thing& thing, const vec3& pos, const vec3& normal,
 		const vec3& rd, const Scene& scene, const color& col,
-		const light& light_) const
+		const light& light_, bool* in_shadow = nullptr,
+		occluder_cache* occluders = nullptr, const std::uint32_t light_index = 0) const
 	{
 		const vec3 ldis = light_.pos - pos;
+		const auto falloff = light_falloff(mag(ldis), light_.range);
+		if (falloff <= 0.0f) {
+			return col;
+		}
 		const vec3 livec = norm(ldis);
-		const auto near_isect = test_ray({ pos, livec }, scene);
-		const bool is_in_shadow = near_isect ? *near_isect < mag(ldis) : false;
+		const bool is_in_shadow = occluded({ pos, livec }, mag(ldis), scene, occluders, light_index);
 		if (is_in_shadow) {
+			if (in_shadow) {
+				*in_shadow = true;
+			}
 			return col;
 		}
+		return add_unshadowed_light(thing, pos, normal, rd, col, light_, livec, falloff);
+	}
+
+	// add_light once the light is known to reach pos along livec.
+	constexpr color add_unshadowed_light(const any_thing& thing, const vec3& pos, const vec3& normal,
+		const vec3& rd, const color& col, const light& light_, const vec3& livec, const float falloff) const
+	{
+		const auto lcol = scale(falloff, light_.col);
 		const auto illum = dot(livec, normal);
-		const auto lcolor = (illum > 0) ? scale(illum, light_.col) : color::default_color();
+		const auto lcolor = (illum > 0) ? scale(illum, lcol) : color::default_color();
 		const auto specular = dot(livec, norm(rd));
 		const auto& surf = thing.get_surface();
-		const auto scolor = (specular > 0) ? scale(cmath::pow(specular, surf.roughness), light_.col)
+		const auto scolor = (specular > 0) ? scale(static_cast<float>(std::pow(specular, surf.roughness)), lcol)
 			: color::default_color();
 		return col + (surf.diffuse(pos) * lcolor) + (surf.specular(pos) * scolor);
 	}
 
 	template <typename Scene>
 	constexpr color get_natural_color(const any_thing& thing, const vec3& pos,
-		const vec3& norm_, const vec3& rd, const Scene& scene) const
+		const vec3& norm_, const vec3& rd, const Scene& scene,
+		std::uint32_t* shadow_mask = nullptr, const light_list* lights = nullptr, occluder_cache* occluders = nullptr) const
 	{
 		color col = color::default_color();
-		for (const auto& light : scene.get_lights()) {
-			col = add_light(thing, pos, norm_, rd, scene, col, light);
+		// Lights past the 32nd share bits; the mask is only a coherence hint.
+		const auto mark_shadowed = [&](const std::uint32_t index) {
+			if (shadow_mask) {
+				*shadow_mask |= 1u << (index % 32);
+			}
+		};
+		if constexpr (has_scene_occluded_packet<Scene>::value) {
+			// Gathers the shadow rays of up to shadow_packet::width lights
+			// and adds those lights in the order visited once the packet is
+			// tested, so the sum is the same as one light at a time.
+			struct pending_light {
+				const light* light_;
+				std::uint32_t index;
+				vec3 livec;
+				float falloff;
+			};
+			shadow_packet packet{ pos };
+			pending_light pending[shadow_packet::width];
+			const auto flush = [&] {
+				const auto blocked = scene.occluded(packet);
+				for (auto i = 0; i < packet.count; i++) {
+					const auto& p = pending[i];
+					if (blocked & (1u << i)) {
+						mark_shadowed(p.index);
+					}
+					else {
+						col = add_unshadowed_light(thing, pos, norm_, rd, col, *p.light_, p.livec, p.falloff);
+					}
+				}
+				packet.count = 0;
+			};
+			for_each_light(scene, pos, lights, [&](const light& light_, const std::uint32_t index) {
+				const vec3 ldis = light_.pos - pos;
+				const auto dist = mag(ldis);
+				const auto falloff = light_falloff(dist, light_.range);
+				if (falloff <= 0.0f) {
+					return;
+				}
+				const vec3 livec = norm(ldis);
+				pending[packet.add(livec, dist)] = { &light_, index, livec, falloff };
+				if (packet.full()) {
+					flush();
+				}
+			});
+			if (packet.count > 0) {
+				flush();
+			}
+		}
+		else {
+			for_each_light(scene, pos, lights, [&](const light& light_, const std::uint32_t index) {
+				auto in_shadow{ false };
+				col = add_light(thing, pos, norm_, rd, scene, col, light_, &in_shadow, occluders, index);
+				if (in_shadow) {
+					mark_shadowed(index);
+				}
+			});
 		}
 		return col;
 	}
 
+	// Calls f(light, index) for the lights to shade pos with: those in
+	// lights when given, otherwise those the scene's light tree finds
+	// reaching pos, otherwise all of them.
+	template <typename Scene, typename F>
+	constexpr void for_each_light(const Scene& scene, const vec3& pos, const light_list* lights, F&& f) const {
+		if (lights) {
+			const auto& all = scene_lights(scene);
+			for (std::uint32_t i = 0; i < lights->count; i++) {
+				f(all[lights->indices[i]], lights->indices[i]);
+			}
+		}
+		else if constexpr (has_scene_light_tree<Scene>::value) {
+			scene.get_light_tree().for_each_reaching(pos, f);
+		}
+		else {
+			auto index{ 0u };
+			for (const auto& light : scene.get_lights()) {
+				f(light, index++);
+			}
+		}
+	}
+
+	// Traces a tile's primary rays before shading any of them, so that their
+	// hits can be shaded with only the lights reaching the box around them.
+	// Reflections may land anywhere and are still shaded with every light.
+	template <typename Scene>
+	void trace_tile_culled(const Scene& scene, const tile& t, const int width, const int height,
+		arena& scratch, color* pixels, render_stats& stats, occluder_cache& occluders) const {
+		const auto count = t.width * t.height;
+		auto* hits = scratch.allocate_array<intersection>(count);
+		auto* hit = scratch.allocate_array<bool>(count);
+		aabb box{};
+		for (auto y = 0; y < t.height; y++) {
+			for (auto x = 0; x < t.width; x++) {
+				const auto i = y * t.width + x;
+				const auto& point{ get_point(width, height, t.x0 + x, t.y0 + y, scene.get_camera()) };
+				const auto& isect{ get_intersections({ scene.get_camera().pos, point }, scene) };
+				hit[i] = static_cast<bool>(isect);
+				if (isect) {
+					hits[i] = *isect;
+					box.grow((isect->dist * isect->ray_.dir) + isect->ray_.start);
+				}
+			}
+		}
+
+		const auto& lights = scene_lights(scene);
+		auto* indices = scratch.allocate_array<std::uint32_t>(lights.size());
+		std::uint32_t reaching{ 0 };
+		if (!box.empty()) {
+			if constexpr (has_scene_light_tree<Scene>::value) {
+				// In the tree's order: the lights reaching any one hit come in
+				// the same order as for_each_light visits them, and the rest
+				// add nothing, so pixels match a render without tiles. With a
+				// cull threshold the rest may add less than the threshold.
+				scene.get_light_tree().for_each_reaching(box, [&](const light&, const std::uint32_t index) {
+					indices[reaching++] = index;
+				});
+			}
+			else {
+				for (std::uint32_t i = 0; i < lights.size(); i++) {
+					if (light_reaches(lights[i], box)) {
+						indices[reaching++] = i;
+					}
+				}
+			}
+		}
+		const light_list tile_lights{ indices, reaching };
+		for (auto i = 0; i < count; i++) {
+			pixels[i] = hit[i] ? shade(hits[i], scene, 0, nullptr, &tile_lights, &occluders) : color::background();
+		}
+		stats.culled_lights += lights.size() - reaching;
+	}
+
 	constexpr vec3 get_point(int width, int height, int x, int y, const camera& cam) const {
 		const auto recenterX = (x - (width / 2.0f)) / 2.0f / width;
 		const auto recenterY = -(y - (height / 2.0f)) / 2.0f / height;
 		return norm(cam.forward + ((recenterX * cam.right) + (recenterY * cam.up)));
 	}
 
+	// Renders the frame in parallel tiles, staging each tile in the worker's
+	// arena before writing it to the canvas. Canvas::set_pixel must tolerate
+	// concurrent calls for distinct pixels. When any light has a finite
+	// range, each tile is shaded with only the lights that reach it.
+	template <typename Scene, typename Canvas>
+	void render_tiles(const Scene& scene, Canvas& canvas, const int width, const int height, render_context& ctx) const {
+		const auto& lights = scene_lights(scene);
+		const auto cull = std::any_of(lights.begin(), lights.end(), [](const light& l) { return !std::isinf(l.range); });
+		ctx.begin_frame();
+		ctx.for_each_tile(width, height, m_tileSize, [&](const tile& t, arena& scratch, render_stats& stats) {
+			auto* pixels = scratch.allocate_array<color>(t.width * t.height);
+			auto& occluders = ctx.get_occluders(workers::index());
+
+			if (cull) {
+				trace_tile_culled(scene, t, width, height, scratch, pixels, stats, occluders);
+			}
+			else {
+				for (auto y = 0; y < t.height; y++) {
+					for (auto x = 0; x < t.width; x++) {
+						const auto& point{ get_point(width, height, t.x0 + x, t.y0 + y, scene.get_camera()) };
+						pixels[y * t.width + x] = trace_ray({ scene.get_camera().pos, point }, scene, 0, &occluders);
+					}
+				}
+			}
+			for (auto y = 0; y < t.height; y++) {
+				for (auto x = 0; x < t.width; x++) {
+					canvas.set_pixel(t.x0 + x, t.y0 + y, pixels[y * t.width + x]);
+				}
+			}
+			stats.primary_rays += t.width * t.height;
+		});
+	}
+
+	static constexpr int m_tileSize{ 16 };
+
 public:
+	constexpr ray_tracer() = default;
+
+	// max_depth bounds how many reflection bounces are traced per pixel.
+	constexpr explicit ray_tracer(const unsigned int max_depth)
+		: m_maxDepth{ max_depth }
+	{}
+
+	constexpr unsigned int max_depth() const noexcept {
+		return m_maxDepth;
+	}
+
+	// Direction of the camera ray through pixel (x, y).
+	constexpr vec3 primary_dir(const int width, const int height, const int x, const int y, const camera& cam) const {
+		return get_point(width, height, x, y, cam);
+	}
+
+	// Traces the primary ray through pixel (x, y) and also reports what it
+	// hit, for reconstruction passes that interpolate between samples.
+	// Renderers running on render_context workers pass the worker's
+	// occluder cache.
+	template <typename Scene>
+	constexpr pixel_sample sample_pixel(const Scene& scene, const int width, const int height, const int x, const int y,
+		occluder_cache* occluders = nullptr) const {
+		const ray primary{ scene.get_camera().pos, get_point(width, height, x, y, scene.get_camera()) };
+		if (const auto& isect{ get_intersections(primary, scene) }; isect) {
+			pixel_sample sample{ color::background(), isect->thing_, 0 };
+			sample.col = shade(*isect, scene, 0, &sample.shadow_mask, nullptr, occluders);
+			return sample;
+		}
+		return { color::background(), nullptr, 0 };
+	}
+
+	// Calls visit(depth, thing, pos, normal, reflect_dir) for each hit along
+	// the primary ray through pixel (x, y) and its reflections, the hits that
+	// tracing it shades, so that they can be kept and shaded later with
+	// natural_color.
+	template <typename Scene, typename Visit>
+	void for_each_hit(const Scene& scene, const int width, const int height, const int x, const int y, Visit&& visit) const {
+		ray ray_{ scene.get_camera().pos, get_point(width, height, x, y, scene.get_camera()) };
+		for (auto depth = 0u;; depth++) {
+			const auto isect = get_intersections(ray_, scene);
+			if (!isect) {
+				return;
+			}
+			const vec3& d = isect->ray_.dir;
+			const vec3 pos = (isect->dist * d) + isect->ray_.start;
+			const vec3 normal = get_normal(*isect, pos);
+			const vec3 reflect_dir = d - (2 * (dot(normal, d) * normal));
+			visit(depth, *isect->thing_, pos, normal, reflect_dir);
+			if (depth >= m_maxDepth) {
+				return;
+			}
+			ray_ = { pos, reflect_dir };
+		}
+	}
+
+	// The part of shading a hit that depends on the lights: the background
+	// plus what every light adds. Shadow rays are answered by
+	// occluded(light_index, ray, dist), so callers can reuse visibility
+	// known from earlier frames.
+	template <typename Scene, typename Occluded>
+	constexpr color natural_color(const any_thing& thing, const vec3& pos, const vec3& normal, const vec3& reflect_dir,
+		const Scene& scene, Occluded&& occluded) const {
+		color col = color::default_color();
+		for_each_light(scene, pos, nullptr, [&](const light& light_, const std::uint32_t index) {
+			const vec3 ldis = light_.pos - pos;
+			const auto dist = mag(ldis);
+			const auto falloff = light_falloff(dist, light_.range);
+			if (falloff <= 0.0f) {
+				return;
+			}
+			const vec3 livec = norm(ldis);
+			if (!occluded(index, ray{ pos, livec }, dist)) {
+				col = add_unshadowed_light(thing, pos, normal, reflect_dir, col, light_, livec, falloff);
+			}
+		});
+		return color::background() + col;
+	}
+
+	// Whether anything blocks ray_ before dist, retesting the light's last
+	// occluder first when given a cache.
+	template <typename Scene>
+	bool occluded(const ray& ray_, const float dist, const Scene& scene,
+		occluder_cache* occluders = nullptr, const std::uint32_t light_index = 0) const {
+		return occluders ? is_occluded(ray_, dist, scene, *occluders, light_index) : is_occluded(ray_, dist, scene);
+	}
+
+	// The lights ray_tracer shades scene with, by index.
+	template <typename Scene>
+	static constexpr decltype(auto) scene_lights(const Scene& scene) {
+		if constexpr (has_scene_light_tree<Scene>::value) {
+			return scene.get_light_tree().lights();
+		}
+		else {
+			return scene.get_lights();
+		}
+	}
+
+	// Passing a render_context renders in parallel tiles using its
+	// per-thread scratch arenas; without one, render stays a plain serial
+	// loop that can be evaluated at compile time.
 	template <typename Scene, typename Canvas>
-	constexpr void render(const Scene& scene, Canvas& canvas, const int width, const int height) const {
-		
+	constexpr void render(const Scene& scene, Canvas& canvas, const int width, const int height,
+		render_context* ctx = nullptr) const {
+
+		if (ctx) {
+			render_tiles(scene, canvas, width, height, *ctx);
+			return;
+		}
+
 		for (auto y = 0; y < height; y++) {
 			for (auto x = 0; x < width; x++) {
 				const auto& point{ get_point(width, height, x, y, scene.get_camera()) };
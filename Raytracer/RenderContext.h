@@ -0,0 +1,216 @@
+#pragma once
+
+#include "Arena.h"
+#include "OccluderCache.h"
+#include "Workers.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+struct render_stats {
+	std::uint64_t tiles{ 0 };
+	std::uint64_t primary_rays{ 0 };
+	std::uint64_t interpolated_pixels{ 0 };
+	std::uint64_t culled_lights{ 0 };	// summed over tiles shaded with a light list
+	std::uint64_t occluder_lookups{ 0 };
+	std::uint64_t occluder_hits{ 0 };
+
+	constexpr render_stats& operator+=(const render_stats& other) noexcept {
+		tiles += other.tiles;
+		primary_rays += other.primary_rays;
+		interpolated_pixels += other.interpolated_pixels;
+		culled_lights += other.culled_lights;
+		occluder_lookups += other.occluder_lookups;
+		occluder_hits += other.occluder_hits;
+		return *this;
+	}
+};
+
+struct tile {
+	int x0, y0;
+	int width, height;
+};
+
+// Per-frame state for ray_tracer::render: one scratch arena per worker
+// thread. Arenas are created up front and recycled by begin_frame(), so
+// rendering many frames with the same context does no heap allocation.
+//
+// A context renders one frame at a time. A frame left running in the
+// background (see render_async) is stopped by the next begin_frame(), and
+// starting a frame while another is still tiling throws.
+class render_context {
+public:
+	explicit render_context(const std::size_t arena_bytes_per_thread = 1u << 20,
+		const bool use_huge_pages = false, const int thread_count = workers::count())
+	{
+		if (thread_count <= 0) {
+			throw std::invalid_argument{ "a render_context needs at least one thread" };
+		}
+		m_threads.reserve(thread_count);
+		for (auto i = 0; i < thread_count; ++i) {
+			m_threads.push_back({ arena{ arena_bytes_per_thread, use_huge_pages }, nullptr, nullptr });
+		}
+	}
+
+	// Stops the background frame, if any, then recycles every arena and
+	// places fresh per-thread stats and occluder caches at the start of
+	// each one.
+	void begin_frame() {
+		finish_background_frame();
+		begin_background_frame();
+	}
+
+	// begin_frame() for the background frame itself, which must not wait
+	// for itself.
+	void begin_background_frame() {
+		if (m_tiling.load(std::memory_order_acquire)) {
+			throw std::logic_error{ "a render_context renders one frame at a time" };
+		}
+		for (auto& t : m_threads) {
+			t.scratch.reset();
+			t.stats = t.scratch.create<render_stats>();
+			t.occluders = t.scratch.create<occluder_cache>();
+		}
+	}
+
+	// Ends the background frame by forgetting the occluders it cached,
+	// which point into the scene it rendered; that scene may be freed once
+	// the frame is over. Its stats stay readable.
+	void end_background_frame() noexcept {
+		for (auto& t : m_threads) {
+			if (t.occluders) {
+				t.occluders->forget();
+			}
+		}
+	}
+
+	// Notes a frame now rendering in the background; stop() must make it
+	// stop using this context and wait until it has. frame identifies it to
+	// forget_background_frame(). Any earlier one is stopped first.
+	void set_background_frame(std::function<void()> stop, const void* frame) {
+		finish_background_frame();
+		m_stopBackground = std::move(stop);
+		m_backgroundFrame = frame;
+	}
+
+	// Drops the stop hook of frame, which has finished, so that the context
+	// no longer keeps alive what the hook holds. A later frame's is kept.
+	void forget_background_frame(const void* frame) noexcept {
+		if (frame == m_backgroundFrame) {
+			m_stopBackground = nullptr;
+			m_backgroundFrame = nullptr;
+		}
+	}
+
+	// Stops the background frame and waits for it, if there is one.
+	void finish_background_frame() {
+		if (m_stopBackground) {
+			const auto stop = std::move(m_stopBackground);
+			m_stopBackground = nullptr;
+			m_backgroundFrame = nullptr;
+			stop();
+		}
+	}
+
+	int thread_count() const noexcept {
+		return static_cast<int>(m_threads.size());
+	}
+
+	arena& get_arena(const int thread) noexcept {
+		return m_threads[thread].scratch;
+	}
+
+	render_stats& get_stats(const int thread) noexcept {
+		return *m_threads[thread].stats;
+	}
+
+	occluder_cache& get_occluders(const int thread) noexcept {
+		return *m_threads[thread].occluders;
+	}
+
+	// Calls func(tile, scratch, stats) for every tile_size square of a
+	// width x height frame, spread over the worker threads. Whatever func
+	// allocates from the worker's arena is released once the tile is done.
+	// If func throws, the tiles not yet started are skipped and the first
+	// exception is rethrown once the workers are done.
+	template <typename Func>
+	void for_each_tile(const int width, const int height, const int tile_size, Func&& func) {
+		const auto tiles_x = (width + tile_size - 1) / tile_size;
+		const auto tiles_y = (height + tile_size - 1) / tile_size;
+		const auto tile_count = tiles_x * tiles_y;
+		if (m_tiling.exchange(true, std::memory_order_acq_rel)) {
+			throw std::logic_error{ "a render_context renders one frame at a time" };
+		}
+		struct tiling_guard {
+			std::atomic<bool>& tiling;
+			~tiling_guard() {
+				tiling.store(false, std::memory_order_release);
+			}
+		} guard{ m_tiling };
+
+		std::atomic<bool> failed{ false };
+		std::exception_ptr error;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(thread_count())
+#endif
+		for (auto i = 0; i < tile_count; i++) {
+			if (failed.load(std::memory_order_relaxed)) {
+				continue;
+			}
+			const auto thread = workers::index();
+			auto& scratch = get_arena(thread);
+			auto& stats = get_stats(thread);
+			const auto mark = scratch.mark();
+
+			const auto x0 = (i % tiles_x) * tile_size;
+			const auto y0 = (i / tiles_x) * tile_size;
+			const tile t{ x0, y0, std::min(tile_size, width - x0), std::min(tile_size, height - y0) };
+			try {
+				func(t, scratch, stats);
+				stats.tiles++;
+			}
+			catch (...) {
+				if (!failed.exchange(true, std::memory_order_acq_rel)) {
+					error = std::current_exception();
+				}
+			}
+			scratch.rewind(mark);
+		}
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	// Totals for the last frame rendered with this context.
+	render_stats frame_stats() const noexcept {
+		render_stats total{};
+		for (const auto& t : m_threads) {
+			if (t.stats) {
+				total += *t.stats;
+			}
+			if (t.occluders) {
+				total.occluder_lookups += t.occluders->lookups;
+				total.occluder_hits += t.occluders->hits;
+			}
+		}
+		return total;
+	}
+
+private:
+	struct per_thread {
+		arena scratch;
+		render_stats* stats;
+		occluder_cache* occluders;
+	};
+
+	std::vector<per_thread> m_threads;
+	std::atomic<bool> m_tiling{ false };		// set while for_each_tile runs
+	std::function<void()> m_stopBackground;	// stops the frame left rendering in the background
+	const void* m_backgroundFrame{ nullptr };	// identifies that frame
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+// Versions of a scene, so that it can be edited while frames are being
+// rendered from it. Each version is immutable: writers publish a whole new
+// one, and a frame pins the current version when it starts and renders
+// that one throughout, never seeing an edit half made. A version is freed
+// once a newer one is current and the last frame pinned to it lets go.
+//
+// Pinning is one atomic load per frame; tracing then reads the pinned
+// scene through a plain reference, so rays take no locks. Writers are
+// serialised among themselves only.
+//
+// An edit copies the scene, so scenes meant for frequent edits should hold
+// their large, rarely changed parts through shared pointers that versions
+// can share.
+template <typename Scene>
+class scene_versions {
+public:
+	// Keeps one version alive for as long as it is held.
+	using pin = std::shared_ptr<const Scene>;
+
+	explicit scene_versions(Scene initial)
+		: m_current{ std::make_shared<const Scene>(std::move(initial)) }
+	{}
+
+	scene_versions(const scene_versions&) = delete;
+	scene_versions& operator=(const scene_versions&) = delete;
+
+	// The latest version, for one frame to render.
+	pin current() const noexcept {
+#ifdef __cpp_lib_atomic_shared_ptr
+		return m_current.load(std::memory_order_acquire);
+#else
+		return std::atomic_load_explicit(&m_current, std::memory_order_acquire);
+#endif
+	}
+
+	// Makes next the version frames starting from now on render.
+	void publish(Scene next) {
+		const std::lock_guard<std::mutex> lock{ m_writers };
+		store(std::make_shared<const Scene>(std::move(next)));
+	}
+
+	// Publishes a copy of the current version changed by edit(Scene&).
+	// Edits from several threads apply one after another, each to the
+	// result of the last.
+	template <typename Edit>
+	void edit(Edit&& edit) {
+		const std::lock_guard<std::mutex> lock{ m_writers };
+		auto next = std::make_shared<Scene>(*current());
+		edit(*next);
+		store(std::move(next));
+	}
+
+private:
+	void store(pin next) noexcept {
+#ifdef __cpp_lib_atomic_shared_ptr
+		m_current.store(std::move(next), std::memory_order_release);
+#else
+		std::atomic_store_explicit(&m_current, std::move(next), std::memory_order_release);
+#endif
+	}
+
+#ifdef __cpp_lib_atomic_shared_ptr
+	std::atomic<pin> m_current;
+#else
+	pin m_current;	// accessed only through the atomic shared_ptr functions
+#endif
+	std::mutex m_writers;
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "Bvh.h"
+#include "Geometry.h"
+
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__AVX__)
+	#define HAVE_AVX_INTRINSICS
+	#include <immintrin.h>
+#endif
+
+// Shadow rays from one shading point towards up to `width` lights, stored
+// structure-of-arrays so that a node is tested against every ray at once.
+// Lane i is the ray { origin, dir_i } blocked only by hits in (0, t_max_i).
+struct shadow_packet {
+	static constexpr int width{ 8 };
+
+	explicit constexpr shadow_packet(const vec3& origin_) noexcept
+		: origin{ origin_ }
+	{}
+
+	// dir must be normalised; returns the lane used.
+	int add(const vec3& dir, const float t_max_) noexcept {
+		dir_x[count] = dir.x;
+		dir_y[count] = dir.y;
+		dir_z[count] = dir.z;
+		inv_x[count] = 1.0f / dir.x;
+		inv_y[count] = 1.0f / dir.y;
+		inv_z[count] = 1.0f / dir.z;
+		t_max[count] = t_max_;
+		return count++;
+	}
+
+	constexpr bool full() const noexcept {
+		return count == width;
+	}
+
+	constexpr std::uint32_t lanes() const noexcept {
+		return (1u << count) - 1;
+	}
+
+	constexpr ray lane(const int i) const noexcept {
+		return { origin, { dir_x[i], dir_y[i], dir_z[i] } };
+	}
+
+	vec3 origin;
+	alignas(32) float dir_x[width]{};
+	alignas(32) float dir_y[width]{};
+	alignas(32) float dir_z[width]{};
+	alignas(32) float inv_x[width]{};
+	alignas(32) float inv_y[width]{};
+	alignas(32) float inv_z[width]{};
+	alignas(32) float t_max[width]{};
+	int count{ 0 };
+};
+
+namespace shadow_packet_detail {
+	// The subset of lanes whose rays overlap b, with the same slab test as
+	// bvh_ray::enter. The offsets of b from the shared origin are worked out
+	// once for all lanes, and a box around the origin is entered by all.
+	inline std::uint32_t enter_mask(const shadow_packet& p, const aabb& b, const std::uint32_t lanes) noexcept {
+		const vec3 lo{ b.lo - p.origin };
+		const vec3 hi{ b.hi - p.origin };
+		if (lo.x <= 0.0f && lo.y <= 0.0f && lo.z <= 0.0f && hi.x >= 0.0f && hi.y >= 0.0f && hi.z >= 0.0f) {
+			return lanes;
+		}
+#ifdef HAVE_AVX_INTRINSICS
+		const auto ix = _mm256_load_ps(p.inv_x);
+		const auto iy = _mm256_load_ps(p.inv_y);
+		const auto iz = _mm256_load_ps(p.inv_z);
+		const auto tx0 = _mm256_mul_ps(_mm256_set1_ps(lo.x), ix);
+		const auto tx1 = _mm256_mul_ps(_mm256_set1_ps(hi.x), ix);
+		const auto ty0 = _mm256_mul_ps(_mm256_set1_ps(lo.y), iy);
+		const auto ty1 = _mm256_mul_ps(_mm256_set1_ps(hi.y), iy);
+		const auto tz0 = _mm256_mul_ps(_mm256_set1_ps(lo.z), iz);
+		const auto tz1 = _mm256_mul_ps(_mm256_set1_ps(hi.z), iz);
+		const auto enter = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+			_mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+		const auto exit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+			_mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_load_ps(p.t_max)));
+		return static_cast<std::uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ))) & lanes;
+#else
+		std::uint32_t mask{ 0 };
+		for (auto i = 0; i < p.count; i++) {
+			const auto tx0 = lo.x * p.inv_x[i];
+			const auto tx1 = hi.x * p.inv_x[i];
+			const auto ty0 = lo.y * p.inv_y[i];
+			const auto ty1 = hi.y * p.inv_y[i];
+			const auto tz0 = lo.z * p.inv_z[i];
+			const auto tz1 = hi.z * p.inv_z[i];
+			const auto t_near = std::max({ std::min(tx0, tx1), std::min(ty0, ty1), std::min(tz0, tz1), 0.0f });
+			const auto t_far = std::min({ std::max(tx0, tx1), std::max(ty0, ty1), std::max(tz0, tz1), p.t_max[i] });
+			mask |= (t_near <= t_far ? 1u : 0u) << i;
+		}
+		return mask & lanes;
+#endif
+	}
+	// Squared distance from p to b.
+	inline float gap(const aabb& b, const vec3& p) noexcept {
+		const vec3 d{ std::max({ b.lo.x - p.x, 0.0f, p.x - b.hi.x }),
+					  std::max({ b.lo.y - p.y, 0.0f, p.y - b.hi.y }),
+					  std::max({ b.lo.z - p.z, 0.0f, p.z - b.hi.z }) };
+		return dot(d, d);
+	}
+} // end namespace shadow_packet_detail
+
+// Walks tree once for every lane of p and returns the lanes blocked before
+// their t_max. occludes(slot, lanes) returns which of the given lanes the
+// primitive blocks. A subtree is visited while any unblocked lane reaches
+// it, and the walk stops once every lane is blocked.
+template <typename Occludes>
+std::uint32_t packet_any_hit(const bvh& tree, const shadow_packet& p, Occludes&& occludes) {
+	const auto& nodes = tree.nodes();
+	const auto all = p.lanes();
+	if (nodes.empty() || all == 0) {
+		return 0;
+	}
+	struct entry {
+		std::uint32_t node;
+		std::uint32_t lanes;
+	};
+	entry stack[bvh::max_depth + 1];
+	auto top{ 0 };
+	auto open{ all };
+	stack[top++] = { 0, all };
+
+	while (top > 0) {
+		const auto e = stack[--top];
+		const auto& n = nodes[e.node];
+		const auto lanes = shadow_packet_detail::enter_mask(p, n.bounds, e.lanes & open);
+		if (lanes == 0) {
+			continue;
+		}
+		if (n.is_leaf()) {
+			for (auto i = n.first; i < n.first + n.count; i++) {
+				open &= ~occludes(i, lanes & open);
+				if ((lanes & open) == 0) {
+					break;
+				}
+			}
+			if (open == 0) {
+				return all;
+			}
+		}
+		else {
+			// Occluders near the shared origin block the most lanes, so the
+			// child nearer to it goes first.
+			const auto near_first = shadow_packet_detail::gap(nodes[n.first].bounds, p.origin) <=
+				shadow_packet_detail::gap(nodes[n.first + 1].bounds, p.origin);
+			stack[top++] = { near_first ? n.first + 1 : n.first, lanes };
+			stack[top++] = { near_first ? n.first : n.first + 1, lanes };
+		}
+	}
+	return all & ~open;
+}
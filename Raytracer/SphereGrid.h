@@ -0,0 +1,403 @@
+#pragma once
+
+#include "Accelerator.h"
+#include "Bvh.h"
+#include "Thing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+enum class grid_layout {
+	uniform,	// one bucket per cell, with the cell size chosen from the sphere count
+	hashed		// cells about one sphere across, hashed into 2n buckets; for sparse scenes
+};
+
+struct sphere_grid_settings {
+	grid_layout layout{ grid_layout::uniform };
+	float cells_per_sphere{ 2.0f };	// uniform: target number of cells per sphere
+	int max_resolution{ 512 };	// uniform: most cells along any axis
+};
+
+// Grid over the spheres of a scene, for particle systems of similar-sized
+// spheres that move every frame. Building is a linear-time parallel
+// counting sort of the spheres into the cells their bounds overlap, cheap
+// enough to redo each frame; rays walk the cells in order with 3D-DDA and
+// stop at the first cell that ends beyond the closest hit. The hashed layout
+// also keeps a coarse occupancy grid, about one cell per sphere, so rays
+// cross the empty space between clusters a coarse cell at a time. Things
+// other than spheres go into a small BVH alongside.
+//
+// It has the constructor and queries of thing_accelerator, so a scene picks
+// between them by the accelerator type it holds and forwards to:
+//
+//     std::optional<intersection> intersect(const ray& r) const { return accel.intersect(r); }
+//     bool occluded(const ray& r, float t_max) const { return accel.occluded(r, t_max); }
+class sphere_grid {
+public:
+	explicit sphere_grid(const std::vector<any_thing>& things, const sphere_grid_settings& settings = {})
+		: m_settings{ settings }
+	{
+		build(things);
+	}
+
+	// Rebuilds from scratch, e.g. after the spheres have moved.
+	void build(const std::vector<any_thing>& things) {
+		std::vector<any_thing> others;
+		m_things.clear();
+		m_spheres.clear();
+		for (const auto& t : things) {
+			if (const auto* s = t.get_if<sphere>(); s) {
+				m_things.push_back(t);
+				m_spheres.push_back(*s);
+			}
+			else {
+				others.push_back(t);
+			}
+		}
+		m_others = thing_accelerator<bvh>{ others };
+
+		m_bounds = {};
+		auto max_radius{ 0.0f };
+		for (const auto& s : m_spheres) {
+			const auto r = std::sqrt(s.radius2);
+			m_bounds.grow(aabb{ s.centre - vec3{ r, r, r }, s.centre + vec3{ r, r, r } });
+			max_radius = std::max(max_radius, r);
+		}
+		m_entries.clear();
+		m_cell_start.assign(1, 0);
+		m_coarse.clear();
+		if (m_spheres.empty()) {
+			return;
+		}
+		size_cells(max_radius);
+		mark_coarse();
+
+		const auto n = static_cast<std::int64_t>(m_spheres.size());
+		std::vector<std::atomic<std::uint32_t>> cursor(m_bucket_count);
+		for (auto& c : cursor) {
+			c.store(0, std::memory_order_relaxed);
+		}
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (std::int64_t i = 0; i < n; i++) {
+			for_each_bucket(m_spheres[i], [&](const std::size_t b) {
+				cursor[b].fetch_add(1, std::memory_order_relaxed);
+			});
+		}
+
+		m_cell_start.resize(m_bucket_count + 1);
+		for (std::size_t b = 0; b < m_bucket_count; b++) {
+			m_cell_start[b + 1] = m_cell_start[b] + cursor[b].load(std::memory_order_relaxed);
+			cursor[b].store(m_cell_start[b], std::memory_order_relaxed);
+		}
+		m_entries.resize(m_cell_start[m_bucket_count]);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+		for (std::int64_t i = 0; i < n; i++) {
+			for_each_bucket(m_spheres[i], [&](const std::size_t b) {
+				m_entries[cursor[b].fetch_add(1, std::memory_order_relaxed)] = static_cast<std::uint32_t>(i);
+			});
+		}
+	}
+
+	// Closest hit in (0, t_max); shrinks t_max on a hit.
+	bool closest_hit(const ray& r, float& t_max, intersection& hit) const {
+		auto found = m_others.closest_hit(r, t_max, hit);
+		walk(r, t_max, [&](const std::uint32_t first, const std::uint32_t last) {
+			for (auto e = first; e < last; e++) {
+				const auto s = m_entries[e];
+				const auto isect = m_spheres[s].intersect(&m_things[s], r);
+				if (isect && isect->dist > 0.0f && isect->dist < t_max) {
+					t_max = isect->dist;
+					hit = *isect;
+					found = true;
+				}
+			}
+			return false;
+		});
+		return found;
+	}
+
+	std::optional<intersection> intersect(const ray& r) const {
+		auto t_max{ std::numeric_limits<float>::max() };
+		intersection hit{};
+		if (!closest_hit(r, t_max, hit)) {
+			return std::nullopt;
+		}
+		return hit;
+	}
+
+	bool occluded(const ray& r, const float t_max) const {
+		if (m_others.occluded(r, t_max)) {
+			return true;
+		}
+		auto blocked{ false };
+		walk(r, t_max, [&](const std::uint32_t first, const std::uint32_t last) {
+			for (auto e = first; e < last && !blocked; e++) {
+				const auto s = m_entries[e];
+				const auto isect = m_spheres[s].intersect(&m_things[s], r);
+				blocked = isect && isect->dist > 0.0f && isect->dist < t_max;
+			}
+			return blocked;
+		});
+		return blocked;
+	}
+
+	std::size_t sphere_count() const noexcept {
+		return m_spheres.size();
+	}
+
+	std::size_t bucket_count() const noexcept {
+		return m_bucket_count;
+	}
+
+	// Cell entries per sphere; above 1 where spheres straddle cells.
+	float duplication() const noexcept {
+		return m_spheres.empty() ? 0.0f : static_cast<float>(m_entries.size()) / m_spheres.size();
+	}
+
+private:
+	// Cubic cells, either sized for about cells_per_sphere cells per sphere
+	// over the bounds (uniform) or about one sphere across (hashed).
+	void size_cells(const float max_radius) {
+		const auto e = m_bounds.extent();
+		m_coarse_factor = 1;
+		const auto largest = std::max({ e.x, e.y, e.z, 1e-6f });
+		if (m_settings.layout == grid_layout::uniform) {
+			// Flat or thin scenes still get a sensible cell size.
+			const auto floor_extent = largest * 1e-3f;
+			const auto volume = std::max(e.x, floor_extent) * std::max(e.y, floor_extent) * std::max(e.z, floor_extent);
+			m_cell_size = std::cbrt(volume / (m_settings.cells_per_sphere * m_spheres.size()));
+			m_cell_size = std::max(m_cell_size, largest / m_settings.max_resolution);
+		}
+		else {
+			// Same cell count per sphere, but over the occupied part of the
+			// bounds only, so clustered spheres get cells sized to the clusters.
+			// occupied_volume() leaves m_cell_size at its own coarse cell size,
+			// which the occupancy grid reuses.
+			const auto occupied = occupied_volume();
+			const auto coarse_size = m_cell_size;
+			m_cell_size = std::max({ std::cbrt(occupied / (m_settings.cells_per_sphere * m_spheres.size())),
+				2.0f * max_radius, largest / (1 << 20) });
+			m_coarse_factor = std::max(1, static_cast<int>(coarse_size / m_cell_size));
+		}
+		m_inv_cell = 1.0f / m_cell_size;
+		for (auto a = 0; a < 3; a++) {
+			m_dims[a] = std::max(1, static_cast<int>(std::ceil(component(e, a) * m_inv_cell)));
+			m_coarse_dims[a] = (m_dims[a] + m_coarse_factor - 1) / m_coarse_factor;
+		}
+
+		if (m_settings.layout == grid_layout::uniform) {
+			m_bucket_count = static_cast<std::size_t>(m_dims[0]) * m_dims[1] * m_dims[2];
+		}
+		else {
+			m_bucket_count = 1;
+			while (m_bucket_count < 2 * m_spheres.size()) {
+				m_bucket_count <<= 1;
+			}
+		}
+	}
+
+	// Volume of the cells holding a sphere centre in a coarse grid of about
+	// one cell per sphere over the bounds.
+	float occupied_volume() {
+		const auto e = m_bounds.extent();
+		const auto floor_extent = std::max({ e.x, e.y, e.z, 1e-6f }) * 1e-3f;
+		const vec3 size{ std::max(e.x, floor_extent), std::max(e.y, floor_extent), std::max(e.z, floor_extent) };
+		m_cell_size = std::cbrt(size.x * size.y * size.z / m_spheres.size());
+		m_inv_cell = 1.0f / m_cell_size;
+		for (auto a = 0; a < 3; a++) {
+			m_dims[a] = std::max(1, static_cast<int>(std::ceil(component(size, a) * m_inv_cell)));
+		}
+		std::vector<std::uint8_t> occupied(static_cast<std::size_t>(m_dims[0]) * m_dims[1] * m_dims[2], 0);
+		std::size_t cells{ 0 };
+		for (const auto& s : m_spheres) {
+			auto& o = occupied[cell_of(s.centre.x, 0) + static_cast<std::size_t>(m_dims[0]) *
+				(cell_of(s.centre.y, 1) + static_cast<std::size_t>(m_dims[1]) * cell_of(s.centre.z, 2))];
+			cells += o == 0 ? 1 : 0;
+			o = 1;
+		}
+		return cells * m_cell_size * m_cell_size * m_cell_size;
+	}
+
+	int cell_of(const float v, const int a) const noexcept {
+		const auto c = static_cast<int>(std::floor((v - component(m_bounds.lo, a)) * m_inv_cell));
+		return std::min(std::max(c, 0), m_dims[a] - 1);
+	}
+
+	std::size_t bucket_of(const int x, const int y, const int z) const noexcept {
+		if (m_settings.layout == grid_layout::uniform) {
+			return x + static_cast<std::size_t>(m_dims[0]) * (y + static_cast<std::size_t>(m_dims[1]) * z);
+		}
+		const auto h = (static_cast<std::uint32_t>(x) * 73856093u) ^ (static_cast<std::uint32_t>(y) * 19349663u) ^
+			(static_cast<std::uint32_t>(z) * 83492791u);
+		return h & (m_bucket_count - 1);
+	}
+
+	// Calls f(bucket) for each cell the sphere's bounds overlap, padded a
+	// little so that hits on a cell face are found from either side.
+	void cell_range(const sphere& s, int lo[3], int hi[3]) const noexcept {
+		const auto r = std::sqrt(s.radius2) + 1e-4f * m_cell_size;
+		for (auto a = 0; a < 3; a++) {
+			lo[a] = cell_of(component(s.centre, a) - r, a);
+			hi[a] = cell_of(component(s.centre, a) + r, a);
+		}
+	}
+
+	template <typename F>
+	void for_each_bucket(const sphere& s, F&& f) const {
+		int lo[3];
+		int hi[3];
+		cell_range(s, lo, hi);
+		for (auto z = lo[2]; z <= hi[2]; z++) {
+			for (auto y = lo[1]; y <= hi[1]; y++) {
+				for (auto x = lo[0]; x <= hi[0]; x++) {
+					f(bucket_of(x, y, z));
+				}
+			}
+		}
+	}
+
+	// Marks the coarse cells overlapped by any sphere's cells.
+	void mark_coarse() {
+		if (m_coarse_factor == 1) {
+			return;
+		}
+		m_coarse.assign(static_cast<std::size_t>(m_coarse_dims[0]) * m_coarse_dims[1] * m_coarse_dims[2], 0);
+		for (const auto& s : m_spheres) {
+			int lo[3];
+			int hi[3];
+			cell_range(s, lo, hi);
+			for (auto z = lo[2] / m_coarse_factor; z <= hi[2] / m_coarse_factor; z++) {
+				for (auto y = lo[1] / m_coarse_factor; y <= hi[1] / m_coarse_factor; y++) {
+					for (auto x = lo[0] / m_coarse_factor; x <= hi[0] / m_coarse_factor; x++) {
+						m_coarse[x + static_cast<std::size_t>(m_coarse_dims[0]) * (y + static_cast<std::size_t>(m_coarse_dims[1]) * z)] = 1;
+					}
+				}
+			}
+		}
+	}
+
+	// 3D-DDA from t_start over the cells of side size, counted from
+	// m_bounds.lo, in the box [lo, hi). Calls f(cell, t_in) with each cell
+	// and the distance at which the ray enters it. Returns true once f
+	// returns true or the next cell starts beyond t_max, false when the ray
+	// leaves the box.
+	template <typename F>
+	bool step_cells(const ray& r, const bvh_ray& br, const float t_start, const float size, const int lo[3],
+		const int hi[3], const float& t_max, F&& f) const {
+		const auto p = (t_start * r.dir) + r.start;
+		int cell[3];
+		int step[3];
+		int end[3];
+		float t_next[3];
+		float t_delta[3];
+		for (auto a = 0; a < 3; a++) {
+			const auto d = component(r.dir, a);
+			const auto inv = component(br.inv_dir, a);
+			const auto o = component(m_bounds.lo, a) - component(r.start, a);
+			const auto c = static_cast<int>(std::floor((component(p, a) - component(m_bounds.lo, a)) / size));
+			cell[a] = std::min(std::max(c, lo[a]), hi[a] - 1);
+			if (d > 0.0f) {
+				step[a] = 1;
+				end[a] = hi[a];
+				t_next[a] = (o + (cell[a] + 1) * size) * inv;
+				t_delta[a] = size * inv;
+			}
+			else if (d < 0.0f) {
+				step[a] = -1;
+				end[a] = lo[a] - 1;
+				t_next[a] = (o + cell[a] * size) * inv;
+				t_delta[a] = -size * inv;
+			}
+			else {
+				step[a] = 0;
+				end[a] = lo[a] - 1;
+				t_next[a] = std::numeric_limits<float>::infinity();
+				t_delta[a] = 0.0f;
+			}
+		}
+
+		auto t_in = t_start;
+		for (;;) {
+			if (f(cell, t_in)) {
+				return true;
+			}
+			const auto a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+			if (t_max <= t_next[a]) {
+				return true;
+			}
+			cell[a] += step[a];
+			if (cell[a] == end[a]) {
+				return false;
+			}
+			t_in = t_next[a];
+			t_next[a] += t_delta[a];
+		}
+	}
+
+	// Visits the cells along r in order, calling visit(first, last) with
+	// each cell's range of m_entries. Stops when visit returns true, when
+	// the ray leaves the grid, or at the first cell ending beyond t_max,
+	// which visit may shrink: any closer hit lies in a cell already visited.
+	// With a coarse level, only the cells of occupied coarse cells are
+	// visited.
+	template <typename Visit>
+	void walk(const ray& r, const float& t_max, Visit&& visit) const {
+		if (m_entries.empty()) {
+			return;
+		}
+		const bvh_ray br{ r };
+		const auto t_enter = br.enter(m_bounds, t_max);
+		if (t_enter == std::numeric_limits<float>::infinity()) {
+			return;
+		}
+
+		const auto visit_cell = [&](const int cell[3], float) {
+			const auto b = bucket_of(cell[0], cell[1], cell[2]);
+			return visit(m_cell_start[b], m_cell_start[b + 1]);
+		};
+		const int none[3]{ 0, 0, 0 };
+		if (m_coarse.empty()) {
+			step_cells(r, br, t_enter, m_cell_size, none, m_dims, t_max, visit_cell);
+			return;
+		}
+		step_cells(r, br, t_enter, m_coarse_factor * m_cell_size, none, m_coarse_dims, t_max,
+			[&](const int coarse[3], const float t_in) {
+				if (!m_coarse[coarse[0] + static_cast<std::size_t>(m_coarse_dims[0]) *
+					(coarse[1] + static_cast<std::size_t>(m_coarse_dims[1]) * coarse[2])]) {
+					return false;
+				}
+				int lo[3];
+				int hi[3];
+				for (auto a = 0; a < 3; a++) {
+					lo[a] = coarse[a] * m_coarse_factor;
+					hi[a] = std::min(lo[a] + m_coarse_factor, m_dims[a]);
+				}
+				return step_cells(r, br, t_in, m_cell_size, lo, hi, t_max, visit_cell);
+			});
+	}
+
+	sphere_grid_settings m_settings;
+	std::vector<any_thing> m_things;	// the spheres, for the thing pointer in intersections
+	std::vector<sphere> m_spheres;	// the same spheres, tested without dispatch
+	thing_accelerator<bvh> m_others{ std::vector<any_thing>{} };
+
+	aabb m_bounds{};
+	float m_cell_size{ 1.0f };
+	float m_inv_cell{ 1.0f };
+	int m_dims[3]{ 1, 1, 1 };
+	int m_coarse_factor{ 1 };	// cells along each axis of a coarse cell
+	int m_coarse_dims[3]{ 1, 1, 1 };
+	std::vector<std::uint8_t> m_coarse;	// 1 for coarse cells overlapping a sphere; empty when there is no coarse level
+	std::size_t m_bucket_count{ 0 };
+	std::vector<std::uint32_t> m_cell_start;	// m_entries range of bucket b is [m_cell_start[b], m_cell_start[b + 1])
+	std::vector<std::uint32_t> m_entries;	// sphere indices, sorted by bucket
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "Bvh.h"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// bvh whose queries walk the tree through parent links instead of keeping a
+// stack (after Hapala et al., "Efficient Stack-less BVH Traversal for Ray
+// Tracing"). A query holds only the current node, the direction it arrived
+// from and t_max, against a stack of up to bvh::max_depth node indices,
+// which suits batches with many rays in flight. The price is re-reading
+// parent nodes on the way back up, and the parent links and split axes it
+// keeps, which plain bvh trees do not.
+//
+// Children are visited in an order fixed for each ray, the lower child on
+// the node's split axis first when the ray points up that axis, so that a
+// walk returning from a child knows whether its sibling is still to be
+// visited. Use as a drop-in Tree, e.g. thing_accelerator<stackless_bvh>.
+class stackless_bvh : public bvh {
+public:
+	stackless_bvh() noexcept
+		: bvh{ true }
+	{}
+
+	template <typename Intersect>
+	bool closest_hit(const ray& r, float& t_max, Intersect&& intersect) const {
+		auto hit{ false };
+		walk<true>(r, t_max, [&](const bvh_node& leaf) {
+			for (auto i = leaf.first; i < leaf.first + leaf.count; i++) {
+				hit |= intersect(i, t_max);
+			}
+			return false;
+		});
+		return hit;
+	}
+
+	template <typename Occludes>
+	bool any_hit(const ray& r, const float t_max, Occludes&& occludes) const {
+		auto t{ t_max };
+		return walk<false>(r, t, [&](const bvh_node& leaf) {
+			for (auto i = leaf.first; i < leaf.first + leaf.count; i++) {
+				if (occludes(i, t_max)) {
+					return true;
+				}
+			}
+			return false;
+		});
+	}
+
+private:
+	enum class arrived { from_parent, from_sibling, from_child };
+
+	// Visits the leaves r reaches within t_max, which visit_leaf may shrink.
+	// Returns true as soon as visit_leaf does. Without Ordered, children are
+	// visited first to second, for queries that stop at any hit.
+	template <bool Ordered, typename VisitLeaf>
+	bool walk(const ray& r, const float& t_max, VisitLeaf&& visit_leaf) const {
+		const auto& n = nodes();
+		const auto& up = parents();
+		const auto& axes = split_axes();
+		if (n.empty()) {
+			return false;
+		}
+		const bvh_ray br{ r };
+		const auto reached = [&](const std::uint32_t i) {
+			return br.enter(n[i].bounds, t_max) != std::numeric_limits<float>::infinity();
+		};
+		const bool backwards[3]{ r.dir.x < 0.0f, r.dir.y < 0.0f, r.dir.z < 0.0f };
+		const auto near_child = [&](const std::uint32_t parent) {
+			const auto first = n[parent].first;
+			if constexpr (Ordered) {
+				return backwards[axes[parent]] ? first + 1 : first;
+			}
+			else {
+				return first;
+			}
+		};
+		const auto sibling = [&](const std::uint32_t child) {
+			const auto first = n[up[child]].first;
+			return child == first ? first + 1 : first;
+		};
+
+		if (!reached(0)) {
+			return false;
+		}
+		if (n[0].is_leaf()) {
+			return visit_leaf(n[0]);
+		}
+		auto current = near_child(0);
+		auto state = arrived::from_parent;
+		for (;;) {
+			if (state == arrived::from_child) {
+				if (current == 0) {
+					return false;
+				}
+				// Leaving the near child moves on to the far one; leaving the
+				// far child finishes the parent as well.
+				if (current == near_child(up[current])) {
+					current = sibling(current);
+					state = arrived::from_sibling;
+				}
+				else {
+					current = up[current];
+				}
+				continue;
+			}
+
+			const auto& node = n[current];
+			if (reached(current)) {
+				if (!node.is_leaf()) {
+					current = near_child(current);
+					state = arrived::from_parent;
+					continue;
+				}
+				if (visit_leaf(node)) {
+					return true;
+				}
+			}
+			if (state == arrived::from_parent) {
+				current = sibling(current);
+				state = arrived::from_sibling;
+			}
+			else {
+				current = up[current];
+				state = arrived::from_child;
+			}
+		}
+	}
+};
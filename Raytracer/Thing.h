@@ -0,0 +1,79 @@
+#pragma once
+
+#include "Geometry.h"
+#include "Mesh.h"
+
+#include <cstdint>
+#include <optional>
+#include <variant>
+
+class any_thing {
+	// Workaround for no capturing constexpr lambdas in Clang 4.0
+	struct intersect_visitor {
+		const any_thing* pself;
+		const ray& ray_;
+
+		template <typename Thing>
+		constexpr decltype(auto) operator()(const Thing& thing) const {
+			return thing.intersect(pself, ray_);
+		}
+	};
+
+	struct bounds_visitor {
+		std::optional<aabb> operator()(const sphere& s) const {
+			const auto r = math_constexpr::sqrt(s.radius2);
+			const vec3 e{ r, r, r };
+			return aabb{ s.centre - e, s.centre + e };
+		}
+
+		std::optional<aabb> operator()(const plane&) const {
+			return std::nullopt;
+		}
+
+		std::optional<aabb> operator()(const triangle_mesh& m) const {
+			return m.bounds();
+		}
+	};
+
+	struct normal_visitor {
+		const vec3& pos;
+		std::uint32_t prim;
+
+		template <typename Thing>
+		constexpr decltype(auto) operator()(const Thing& thing) const {
+			return thing.get_normal(pos, prim);
+		}
+	};
+
+public:
+	template <typename T>
+	constexpr any_thing(T&& t) : m_item(std::forward<T>(t)) {}
+
+	constexpr auto intersect(const ray& ray_) const {
+		return std::visit(intersect_visitor{ this, ray_ }, m_item);
+	}
+
+	constexpr vec3 get_normal(const vec3& pos, const std::uint32_t prim = 0) const {
+		return std::visit(normal_visitor{ pos, prim }, m_item);
+	}
+
+	// World-space bounds, or nothing for unbounded things such as planes.
+	std::optional<aabb> bounds() const {
+		return std::visit(bounds_visitor{}, m_item);
+	}
+
+	constexpr const surface& get_surface() const {
+		return std::visit([](const auto& thing_) -> decltype(auto) {
+			return thing_.get_surface();
+		}, m_item);
+	}
+
+	// The contained thing if it is a T, for accelerators specialised to one kind.
+	template <typename T>
+	constexpr const T* get_if() const noexcept {
+		return std::get_if<T>(&m_item);
+	}
+
+private:
+	std::variant<sphere, plane, triangle_mesh> m_item;
+};
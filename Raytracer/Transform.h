@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Bvh.h"
+
+#include <cmath>
+
+// Affine transform stored as the top three rows of a 4x4 matrix.
+struct affine {
+	float m[3][4];
+
+	static constexpr affine identity() noexcept {
+		return { { { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 0.0f } } };
+	}
+
+	static constexpr affine translation(const vec3& t) noexcept {
+		return { { { 1.0f, 0.0f, 0.0f, t.x }, { 0.0f, 1.0f, 0.0f, t.y }, { 0.0f, 0.0f, 1.0f, t.z } } };
+	}
+
+	static constexpr affine scaling(const vec3& s) noexcept {
+		return { { { s.x, 0.0f, 0.0f, 0.0f }, { 0.0f, s.y, 0.0f, 0.0f }, { 0.0f, 0.0f, s.z, 0.0f } } };
+	}
+
+	// Rotation by `radians` about the unit vector `axis`.
+	static affine rotation(const vec3& axis, const float radians) noexcept {
+		const auto c = std::cos(radians);
+		const auto s = std::sin(radians);
+		const auto t = 1.0f - c;
+		const auto& a = axis;
+		return { { { t * a.x * a.x + c, t * a.x * a.y - s * a.z, t * a.x * a.z + s * a.y, 0.0f },
+				   { t * a.x * a.y + s * a.z, t * a.y * a.y + c, t * a.y * a.z - s * a.x, 0.0f },
+				   { t * a.x * a.z - s * a.y, t * a.y * a.z + s * a.x, t * a.z * a.z + c, 0.0f } } };
+	}
+
+	constexpr vec3 point(const vec3& p) const noexcept {
+		return vector(p) + vec3{ m[0][3], m[1][3], m[2][3] };
+	}
+
+	constexpr vec3 vector(const vec3& v) const noexcept {
+		return { m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+				 m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+				 m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z };
+	}
+
+	// Multiplies by the transpose of the linear part. Applied to the inverse
+	// transform, this carries normals the same way this one carries points.
+	constexpr vec3 transposed_vector(const vec3& v) const noexcept {
+		return { m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+				 m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+				 m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z };
+	}
+
+	// this * rhs: applies rhs first.
+	constexpr affine operator*(const affine& rhs) const noexcept {
+		affine r{};
+		for (auto i = 0; i < 3; i++) {
+			for (auto j = 0; j < 4; j++) {
+				r.m[i][j] = m[i][0] * rhs.m[0][j] + m[i][1] * rhs.m[1][j] + m[i][2] * rhs.m[2][j] + (j == 3 ? m[i][3] : 0.0f);
+			}
+		}
+		return r;
+	}
+
+	constexpr affine inverse() const noexcept {
+		const auto det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+			- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+			+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+		const auto inv_det = 1.0f / det;
+
+		affine r{};
+		r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+		r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+		r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+		r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+		r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+		r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+		r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+		r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+		r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+		const auto t = r.vector({ m[0][3], m[1][3], m[2][3] });
+		r.m[0][3] = -t.x;
+		r.m[1][3] = -t.y;
+		r.m[2][3] = -t.z;
+		return r;
+	}
+
+	// Bounds of the transformed corners of b.
+	constexpr aabb apply(const aabb& b) const noexcept {
+		aabb r{};
+		for (auto corner = 0; corner < 8; corner++) {
+			r.grow(point({ corner & 1 ? b.hi.x : b.lo.x, corner & 2 ? b.hi.y : b.lo.y, corner & 4 ? b.hi.z : b.lo.z }));
+		}
+		return r;
+	}
+};
@@ -0,0 +1,307 @@
+#pragma once
+
+#include "Bvh.h"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define HAVE_SSE2_INTRINSICS
+	#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+	#define HAVE_AVX_INTRINSICS
+	#include <immintrin.h>
+#endif
+
+// Node of an N-ary BVH. Child bounds are stored structure-of-arrays so that
+// one ray is tested against every child with a single N-wide slab test.
+template <int N>
+struct alignas(N * sizeof(float)) wide_bvh_node {
+	float lo_x[N], lo_y[N], lo_z[N];
+	float hi_x[N], hi_y[N], hi_z[N];
+	std::uint32_t first[N];	// child node, or first primitive slot for leaf children
+	std::uint32_t count[N];	// primitives for leaf children, 0 for interior children
+	std::uint32_t valid;	// bit i set when child i exists
+};
+
+namespace wide_bvh_detail {
+	// Sets bit i of the result when the ray enters child i within [0, t_max],
+	// with its entry distance in t_near[i].
+	template <int N>
+	inline unsigned slab_test(const wide_bvh_node<N>& n, const bvh_ray& r, const float t_max, float* t_near) noexcept {
+		unsigned mask{ 0 };
+		for (auto i = 0; i < N; i++) {
+			const aabb b{ { n.lo_x[i], n.lo_y[i], n.lo_z[i] }, { n.hi_x[i], n.hi_y[i], n.hi_z[i] } };
+			t_near[i] = r.enter(b, t_max);
+			mask |= (t_near[i] <= t_max ? 1u : 0u) << i;
+		}
+		return mask & n.valid;
+	}
+
+#ifdef HAVE_SSE2_INTRINSICS
+	template <>
+	inline unsigned slab_test<4>(const wide_bvh_node<4>& n, const bvh_ray& r, const float t_max, float* t_near) noexcept {
+		const auto ix = _mm_set1_ps(r.inv_dir.x);
+		const auto iy = _mm_set1_ps(r.inv_dir.y);
+		const auto iz = _mm_set1_ps(r.inv_dir.z);
+		const auto ox = _mm_set1_ps(r.start.x);
+		const auto oy = _mm_set1_ps(r.start.y);
+		const auto oz = _mm_set1_ps(r.start.z);
+		const auto tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.lo_x), ox), ix);
+		const auto tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.hi_x), ox), ix);
+		const auto ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.lo_y), oy), iy);
+		const auto ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.hi_y), oy), iy);
+		const auto tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.lo_z), oz), iz);
+		const auto tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.hi_z), oz), iz);
+		const auto enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+			_mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+		const auto exit = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+			_mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+		_mm_storeu_ps(t_near, enter);
+		return static_cast<unsigned>(_mm_movemask_ps(_mm_cmple_ps(enter, exit))) & n.valid;
+	}
+#endif
+
+#ifdef HAVE_AVX_INTRINSICS
+	template <>
+	inline unsigned slab_test<8>(const wide_bvh_node<8>& n, const bvh_ray& r, const float t_max, float* t_near) noexcept {
+		const auto ix = _mm256_set1_ps(r.inv_dir.x);
+		const auto iy = _mm256_set1_ps(r.inv_dir.y);
+		const auto iz = _mm256_set1_ps(r.inv_dir.z);
+		const auto ox = _mm256_set1_ps(r.start.x);
+		const auto oy = _mm256_set1_ps(r.start.y);
+		const auto oz = _mm256_set1_ps(r.start.z);
+		const auto tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.lo_x), ox), ix);
+		const auto tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.hi_x), ox), ix);
+		const auto ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.lo_y), oy), iy);
+		const auto ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.hi_y), oy), iy);
+		const auto tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.lo_z), oz), iz);
+		const auto tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.hi_z), oz), iz);
+		const auto enter = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+			_mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+		const auto exit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)),
+			_mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(t_max)));
+		_mm256_storeu_ps(t_near, enter);
+		return static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ))) & n.valid;
+	}
+#endif
+
+	// Traversal shared by the N-wide node formats. test(node, ray, t_max,
+	// t_near) returns the mask of children entered, and nodes must provide
+	// first[] and count[] as wide_bvh_node does.
+	struct stack_entry {
+		std::uint32_t first;
+		std::uint32_t count;
+		float t_near;
+	};
+
+	// Visits hit children nearest first, so t_max shrinks as early as possible.
+	template <int N, typename Node, typename Test, typename Intersect>
+	bool closest_hit(const std::vector<Node>& nodes, const ray& r, float& t_max, Test&& test, Intersect&& intersect) {
+		if (nodes.empty()) {
+			return false;
+		}
+		const bvh_ray br{ r };
+		stack_entry stack[bvh::max_depth * N];
+		auto top{ 0 };
+		auto hit{ false };
+		stack[top++] = { 0, 0, 0.0f };
+
+		while (top > 0) {
+			const auto e = stack[--top];
+			if (e.t_near > t_max) {
+				continue;
+			}
+			if (e.count) {
+				for (auto i = e.first; i < e.first + e.count; i++) {
+					hit |= intersect(i, t_max);
+				}
+				continue;
+			}
+
+			const auto& n = nodes[e.first];
+			alignas(32) float t_near[N];
+			auto mask = test(n, br, t_max, t_near);
+			stack_entry hits[N];
+			auto k{ 0 };
+			for (auto i = 0; mask; i++, mask >>= 1) {
+				if (mask & 1) {
+					// Insertion sort, farthest first, so the nearest is popped next.
+					auto j = k++;
+					for (; j > 0 && hits[j - 1].t_near < t_near[i]; j--) {
+						hits[j] = hits[j - 1];
+					}
+					hits[j] = { n.first[i], n.count[i], t_near[i] };
+				}
+			}
+			for (auto j = 0; j < k; j++) {
+				stack[top++] = hits[j];
+			}
+		}
+		return hit;
+	}
+
+	template <int N, typename Node, typename Test, typename Occludes>
+	bool any_hit(const std::vector<Node>& nodes, const ray& r, const float t_max, Test&& test, Occludes&& occludes) {
+		if (nodes.empty()) {
+			return false;
+		}
+		const bvh_ray br{ r };
+		std::uint32_t stack[bvh::max_depth * N];
+		auto top{ 0 };
+		stack[top++] = 0;
+
+		while (top > 0) {
+			const auto& n = nodes[stack[--top]];
+			alignas(32) float t_near[N];
+			auto mask = test(n, br, t_max, t_near);
+			for (auto i = 0; mask; i++, mask >>= 1) {
+				if (!(mask & 1)) {
+					continue;
+				}
+				if (!n.count[i]) {
+					stack[top++] = n.first[i];
+					continue;
+				}
+				for (auto s = n.first[i]; s < n.first[i] + n.count[i]; s++) {
+					if (occludes(s, t_max)) {
+						return true;
+					}
+				}
+			}
+		}
+		return false;
+	}
+} // end namespace wide_bvh_detail
+
+// N-ary BVH (N = 4 or 8) made by collapsing a binary bvh: each node absorbs
+// the children of its largest interior children until it has N of them.
+// Same build and query interface as bvh, so either can back an accelerator.
+template <int N>
+class wide_bvh {
+	static_assert(N >= 2 && N <= 32, "child masks are 32 bits wide");
+
+public:
+	// stats describe the binary tree, except that seconds includes the collapse.
+	template <typename BoundsOf>
+	void build(const std::uint32_t prim_count, BoundsOf&& bounds_of, bvh_build_stats* stats = nullptr) {
+		const auto start = std::chrono::steady_clock::now();
+		bvh binary;
+		binary.build(prim_count, bounds_of, stats);
+		collapse(binary);
+		if (stats) {
+			stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+
+	void collapse(const bvh& binary) {
+		m_nodes.clear();
+		m_prims = binary.prim_indices();
+		m_bounds = binary.bounds();
+		if (binary.nodes().empty()) {
+			return;
+		}
+		m_nodes.emplace_back();
+		fill(binary, 0, 0);
+	}
+
+	template <typename Intersect>
+	bool closest_hit(const ray& r, float& t_max, Intersect&& intersect) const {
+		return wide_bvh_detail::closest_hit<N>(m_nodes, r, t_max, child_test{}, intersect);
+	}
+
+	template <typename Occludes>
+	bool any_hit(const ray& r, const float t_max, Occludes&& occludes) const {
+		return wide_bvh_detail::any_hit<N>(m_nodes, r, t_max, child_test{}, occludes);
+	}
+
+	aabb bounds() const noexcept {
+		return m_bounds;
+	}
+
+	const std::vector<wide_bvh_node<N>>& nodes() const noexcept {
+		return m_nodes;
+	}
+
+	const std::vector<std::uint32_t>& prim_indices() const noexcept {
+		return m_prims;
+	}
+
+	std::size_t memory_bytes() const noexcept {
+		return m_nodes.size() * sizeof(wide_bvh_node<N>) + m_prims.size() * sizeof(std::uint32_t);
+	}
+
+private:
+	struct child_test {
+		unsigned operator()(const wide_bvh_node<N>& n, const bvh_ray& r, const float t_max, float* t_near) const noexcept {
+			return wide_bvh_detail::slab_test(n, r, t_max, t_near);
+		}
+	};
+
+	void fill(const bvh& binary, const std::uint32_t index, const std::uint32_t binary_index) {
+		const auto& src = binary.nodes();
+		std::uint32_t kids[N];
+		auto n{ 0 };
+		if (src[binary_index].is_leaf()) {
+			kids[n++] = binary_index;
+		}
+		else {
+			kids[n++] = src[binary_index].first;
+			kids[n++] = src[binary_index].first + 1;
+			while (n < N) {
+				auto widest{ -1 };
+				auto widest_area{ -1.0f };
+				for (auto i = 0; i < n; i++) {
+					const auto& k = src[kids[i]];
+					if (!k.is_leaf() && k.bounds.surface_area() > widest_area) {
+						widest = i;
+						widest_area = k.bounds.surface_area();
+					}
+				}
+				if (widest < 0) {
+					break;
+				}
+				const auto first = src[kids[widest]].first;
+				kids[widest] = first;
+				kids[n++] = first + 1;
+			}
+		}
+
+		auto& node = m_nodes[index];
+		node = {};
+		for (auto i = 0; i < N; i++) {
+			const auto& b = i < n ? src[kids[i]].bounds : aabb{};
+			node.lo_x[i] = b.lo.x;
+			node.lo_y[i] = b.lo.y;
+			node.lo_z[i] = b.lo.z;
+			node.hi_x[i] = b.hi.x;
+			node.hi_y[i] = b.hi.y;
+			node.hi_z[i] = b.hi.z;
+		}
+		node.valid = (n == 32 ? ~0u : (1u << n) - 1);
+
+		for (auto i = 0; i < n; i++) {
+			const auto& k = src[kids[i]];
+			if (k.is_leaf()) {
+				m_nodes[index].first[i] = k.first;
+				m_nodes[index].count[i] = k.count;
+			}
+			else {
+				const auto child = static_cast<std::uint32_t>(m_nodes.size());
+				m_nodes.emplace_back();
+				m_nodes[index].first[i] = child;
+				m_nodes[index].count[i] = 0;
+				fill(binary, child, kids[i]);
+			}
+		}
+	}
+
+	std::vector<wide_bvh_node<N>> m_nodes;
+	std::vector<std::uint32_t> m_prims;
+	aabb m_bounds{};
+};
+
+using bvh4 = wide_bvh<4>;
+using bvh8 = wide_bvh<8>;
@@ -0,0 +1,23 @@
+#pragma once
+
+#ifdef _OPENMP
+	#include <omp.h>
+#endif
+
+namespace workers {
+	inline int count() noexcept {
+#ifdef _OPENMP
+		return omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+
+	inline int index() noexcept {
+#ifdef _OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+} // end namespace workers